@@ -2,7 +2,10 @@
 // SPDX-License-Identifier: LGPL-2.1-or-later
 
 #include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <sys/queue.h>
 #include <unistd.h>
@@ -16,8 +19,19 @@
 /* Limit the number of extents processed in one call. */
 #define MAX_EXTENTS 4096
 
+/* Identifies a checkpoint file written by blksum. */
+#define CHECKPOINT_MAGIC "BLKSUM01"
+
 enum {HASH_FD=0, SRC_FD};
 
+/* The header of a checkpoint file, followed by the hash state. */
+struct checkpoint {
+    char magic[8];
+    int64_t image_size;
+    int64_t offset;
+    uint64_t state_len;
+};
+
 struct extent_array {
     struct extent *array;
     size_t count;
@@ -55,8 +69,14 @@ struct worker {
     TAILQ_HEAD(, command) hash_queue;
     unsigned commands_in_flight;
 
-    /* The computed checksum. */
-    unsigned char *out;
+    /* For saving the hash state periodically when using --resume. */
+    void *state;
+    size_t state_size;
+    uint64_t next_checkpoint;
+    int64_t checkpoint_offset;
+
+    /* The computed checksums. */
+    unsigned char (*out)[BLKHASH_MAX_MD_SIZE];
     unsigned int *len;
 };
 
@@ -310,6 +330,7 @@ static void read_more_data(struct worker *w)
     }
 }
 
+/* Return the number of completed updates, or -1 on errors. */
 static int complete_updates(struct worker *w)
 {
     struct blkhash_completion completions[w->opt->queue_depth];
@@ -336,13 +357,21 @@ static int complete_updates(struct worker *w)
         update_completed(w, cmd);
     }
 
-    return 0;
+    return n;
 }
 
 static int wait_for_events(struct worker *w)
 {
     int n;
 
+    /* In busy poll mode the completion fd is signaled only after we got no
+     * completions. */
+    if (w->opt->busy_poll) {
+        n = complete_updates(w);
+        if (n != 0)
+            return n < 0 ? -1 : 0;
+    }
+
     if (src_aio_prepare(w->s, &w->poll_fds[SRC_FD]))
         return -1;
 
@@ -380,7 +409,7 @@ static int wait_for_events(struct worker *w)
         }
 
         if (n > 0) {
-            if (complete_updates(w))
+            if (complete_updates(w) < 0)
                 return -1;
         }
     }
@@ -388,14 +417,151 @@ static int wait_for_events(struct worker *w)
     return 0;
 }
 
+static void write_all(int fd, const void *buf, size_t len, const char *path)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            FAIL("Cannot write %s: %s", path, strerror(errno));
+        }
+
+        buf += n;
+        len -= n;
+    }
+}
+
+/*
+ * Save the hash state and the offset of the next byte to hash. The file is
+ * replaced atomically, so a crash while saving keeps the previous
+ * checkpoint.
+ */
+static void save_checkpoint(struct worker *w)
+{
+    struct checkpoint cp = {0};
+    char tmp[PATH_MAX];
+    size_t len = w->state_size;
+    uint64_t start = gettime();
+    int err;
+    int fd;
+
+    err = blkhash_save_state(w->h, w->state, &len);
+    if (err)
+        FAIL("blkhash_save_state: %s", strerror(err));
+
+    memcpy(cp.magic, CHECKPOINT_MAGIC, sizeof(cp.magic));
+    cp.image_size = w->image_size;
+    cp.offset = w->bytes_hashed;
+    cp.state_len = len;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", w->opt->resume);
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        FAIL("Cannot open %s: %s", tmp, strerror(errno));
+
+    write_all(fd, &cp, sizeof(cp), tmp);
+    write_all(fd, w->state, len, tmp);
+
+    if (fsync(fd) != 0)
+        FAIL("Cannot sync %s: %s", tmp, strerror(errno));
+
+    close(fd);
+
+    if (rename(tmp, w->opt->resume) != 0)
+        FAIL("Cannot rename %s: %s", tmp, strerror(errno));
+
+    DEBUG("Saved checkpoint offset=%" PRIi64 " in %" PRIu64 " usec",
+          cp.offset, gettime() - start);
+
+    w->checkpoint_offset = cp.offset;
+    w->next_checkpoint = gettime() + w->opt->checkpoint_interval * 1000000ULL;
+}
+
+/* Load the checkpoint saved by a previous run, if any. */
+static void load_checkpoint(struct worker *w)
+{
+    struct checkpoint cp;
+    ssize_t n;
+    int err;
+    int fd;
+
+    fd = open(w->opt->resume, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            DEBUG("No checkpoint, starting from the beginning");
+            return;
+        }
+        FAIL("Cannot open %s: %s", w->opt->resume, strerror(errno));
+    }
+
+    n = read(fd, &cp, sizeof(cp));
+    if (n != sizeof(cp) ||
+            memcmp(cp.magic, CHECKPOINT_MAGIC, sizeof(cp.magic)) != 0 ||
+            cp.state_len > w->state_size)
+        FAIL("Invalid checkpoint %s", w->opt->resume);
+
+    if (cp.image_size != w->image_size)
+        FAIL("Checkpoint %s does not match image size", w->opt->resume);
+
+    n = read(fd, w->state, cp.state_len);
+    if (n != (ssize_t)cp.state_len)
+        FAIL("Invalid checkpoint %s", w->opt->resume);
+
+    close(fd);
+
+    err = blkhash_load_state(w->h, w->state, cp.state_len);
+    if (err)
+        FAIL("Cannot load checkpoint %s: %s", w->opt->resume, strerror(err));
+
+    w->read_offset = cp.offset;
+    w->bytes_hashed = cp.offset;
+    w->checkpoint_offset = cp.offset;
+
+    if (w->opt->progress)
+        progress_update(cp.offset);
+
+    DEBUG("Resuming from offset=%" PRIi64, cp.offset);
+}
+
+static void init_checkpoint(struct worker *w)
+{
+    int err;
+
+    err = blkhash_save_state(w->h, NULL, &w->state_size);
+    if (err)
+        FAIL("blkhash_save_state: %s", strerror(err));
+
+    w->state = malloc(w->state_size);
+    if (w->state == NULL)
+        FAIL_ERRNO("malloc");
+
+    load_checkpoint(w);
+
+    w->next_checkpoint = gettime() + w->opt->checkpoint_interval * 1000000ULL;
+}
+
 static void process_image(struct worker *w)
 {
     while (w->bytes_hashed < w->image_size) {
-        if (w->read_offset < w->image_size)
+        /* To save a checkpoint, stop reading and wait until all the data
+         * read so far was hashed. Checkpoint only after some progress. */
+        bool checkpoint = w->opt->resume &&
+                          w->bytes_hashed > w->checkpoint_offset &&
+                          gettime() >= w->next_checkpoint;
+
+        if (w->read_offset < w->image_size && !checkpoint)
             read_more_data(w);
 
         hash_more_data(w);
 
+        if (checkpoint && w->commands_in_flight == 0) {
+            assert(w->bytes_hashed == w->read_offset);
+            save_checkpoint(w);
+            continue;
+        }
+
         if (w->commands_in_flight) {
             if (wait_for_events(w))
                 FAIL("Worker failed");
@@ -421,10 +587,27 @@ static void *worker_thread(void *arg)
     if (w->opt->progress)
         progress_init(w->image_size);
 
+    if (w->opt->resume)
+        init_checkpoint(w);
+
     process_image(w);
 
-    if (running())
-        err = blkhash_final(w->h, w->out, w->len);
+    if (running()) {
+        err = blkhash_final(w->h, w->out[0], &w->len[0]);
+        if (err == 0) {
+            for (unsigned i = 1; i < w->opt->digests_count; i++) {
+                err = blkhash_get_digest(w->h, i, w->out[i], &w->len[i]);
+                if (err)
+                    FAIL("blkhash_get_digest: %s", strerror(err));
+            }
+
+            /* The checkpoint is not needed once the image was hashed. */
+            if (w->opt->resume && unlink(w->opt->resume) != 0 &&
+                    errno != ENOENT)
+                ERROR("Cannot remove %s: %s", w->opt->resume,
+                      strerror(errno));
+        }
+    }
 
     src_close(w->s);
 
@@ -443,18 +626,31 @@ static void create_hash(struct worker *w)
     struct blkhash_opts *ho;
     int fd;
 
-    ho = blkhash_opts_new(w->opt->digest_name);
+    ho = blkhash_opts_new(w->opt->digest_names[0]);
     if (ho == NULL)
         FAIL_ERRNO("blkhash_opts_new");
 
+    for (unsigned i = 1; i < w->opt->digests_count; i++) {
+        if (blkhash_opts_add_digest(ho, w->opt->digest_names[i]))
+            FAIL("Invalid digest name: %s", w->opt->digest_names[i]);
+    }
+
     if (blkhash_opts_set_queue_depth(ho, w->opt->queue_depth))
         FAIL("Invalid queue depth value: %u", w->opt->queue_depth);
 
     if (blkhash_opts_set_block_size(ho, w->opt->block_size))
         FAIL("Invalid block size value: %zu", w->opt->block_size);
 
-    if (blkhash_opts_set_threads(ho, w->opt->threads))
-        FAIL("Invalid threads value: %zu", w->opt->threads);
+    set_hash_threads(ho, w->opt);
+
+    if (blkhash_opts_set_busy_poll(ho, w->opt->busy_poll))
+        FAIL("Invalid busy poll value: %u", w->opt->busy_poll);
+
+    set_hash_affinity(ho, w->opt);
+
+    /* Checkpoints save the hash state. */
+    if (w->opt->resume && blkhash_opts_set_resumable(ho, true))
+        FAIL("Cannot enable resumable hash");
 
     w->h = blkhash_new_opts(ho);
     blkhash_opts_free(ho);
@@ -469,8 +665,10 @@ static void create_hash(struct worker *w)
     w->poll_fds[HASH_FD].events = POLLIN;
 }
 
-static void init_worker(struct worker *w, const char *filename, struct options
-                        *opt, unsigned char *out, unsigned int *len)
+static void init_worker(struct worker *w, const char *filename,
+                        struct options *opt,
+                        unsigned char out[][BLKHASH_MAX_MD_SIZE],
+                        unsigned int *len)
 {
     w->opt = opt;
     w->out = out;
@@ -575,6 +773,7 @@ static void destroy_commands(struct worker *w)
 static void destroy_worker(struct worker *w)
 {
     blkhash_free(w->h);
+    free(w->state);
     free(w->uri);
     free(w->extents.array);
     destroy_commands(w);
@@ -588,7 +787,7 @@ static void destroy_worker(struct worker *w)
 }
 
 void aio_checksum(const char *filename, struct options *opt,
-                  unsigned char *out, unsigned int *len)
+                  unsigned char out[][BLKHASH_MAX_MD_SIZE], unsigned int *len)
 {
     struct worker w = {0};
 
@@ -34,7 +34,8 @@ static volatile sig_atomic_t terminated;
 static struct options opt = {
 
     /* The default diget name, override with --digest. */
-    .digest_name = "sha256",
+    .digest_names = {"sha256"},
+    .digests_count = 1,
 
     /*
      * Maximum read size in bytes. The current value gives best
@@ -82,12 +83,23 @@ static struct options opt = {
 
     /* Show progress. */
     .progress = false,
+
+    /* Seconds between checkpoints when using --resume. */
+    .checkpoint_interval = 30,
+
+    /* Run hash workers on any CPU. */
+    .numa_node = -1,
 };
 
 enum {
     QUEUE_DEPTH=CHAR_MAX + 1,
     READ_SIZE,
     BLOCK_SIZE,
+    RESUME,
+    CHECKPOINT_INTERVAL,
+    BUSY_POLL,
+    CPUS,
+    NUMA_NODE,
 };
 
 /* Start with ':' to enable detection of missing argument. */
@@ -103,6 +115,11 @@ static struct option long_options[] = {
    {"queue-depth",  required_argument,  0,  QUEUE_DEPTH},
    {"read-size",    required_argument,  0,  READ_SIZE},
    {"block-size",   required_argument,  0,  BLOCK_SIZE},
+   {"resume",       required_argument,  0,  RESUME},
+   {"checkpoint-interval", required_argument, 0, CHECKPOINT_INTERVAL},
+   {"busy-poll",    required_argument,  0,  BUSY_POLL},
+   {"cpus",         required_argument,  0,  CPUS},
+   {"numa-node",    required_argument,  0,  NUMA_NODE},
    {0,              0,                  0,  0}
 };
 
@@ -113,8 +130,11 @@ static void usage(int code)
         "Compute message digest for disk images\n"
         "\n"
         "    blksum [-d DIGEST|--digest=DIGEST] [-p|--progress]\n"
-        "           [-c|--cache] [-t N|--threads N] [--queue-depth=N]\n"
-        "           [--read-size=N] [--block-size=N] [-l|--list-digests]\n"
+        "           [-c|--cache] [-t N|--threads N|auto] [--queue-depth=N]\n"
+        "           [--read-size=N] [--block-size=N] [--resume=STATEFILE]\n"
+        "           [--checkpoint-interval=N] [--busy-poll=N]\n"
+        "           [--cpus=LIST] [--numa-node=N]\n"
+        "           [-l|--list-digests]\n"
         "           [-h|--help] [filename]\n"
         "\n"
         "Please read the blksum(1) manual page for more info.\n"
@@ -124,6 +144,28 @@ static void usage(int code)
     exit(code);
 }
 
+/* Parse comma separated list of digest names. */
+static void parse_digests(const char *optname, char *value)
+{
+    char *saveptr;
+    char *name;
+
+    opt.digests_count = 0;
+
+    for (name = strtok_r(value, ",", &saveptr);
+         name != NULL;
+         name = strtok_r(NULL, ",", &saveptr)) {
+        if (opt.digests_count == BLKHASH_MAX_DIGESTS)
+            FAIL("Too many digests for option %s (maximum %d)",
+                 optname, BLKHASH_MAX_DIGESTS);
+
+        opt.digest_names[opt.digests_count++] = name;
+    }
+
+    if (opt.digests_count == 0)
+        FAIL("Invalid value for option %s: '%s'", optname, value);
+}
+
 static void parse_options(int argc, char *argv[])
 {
     const char *optname;
@@ -149,7 +191,7 @@ static void parse_options(int argc, char *argv[])
             list_digests();
             break;
         case 'd':
-            opt.digest_name = optarg;
+            parse_digests(optname, optarg);
             break;
         case 'p':
             opt.progress = !!isatty(fileno(stdout));
@@ -159,12 +201,23 @@ static void parse_options(int argc, char *argv[])
             opt.flags |= USER_CACHE;
             break;
         case 't': {
+            if (strcmp(optarg, "auto") == 0) {
+                long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                if (cpus < 1)
+                    cpus = 1;
+
+                opt.threads = MIN(cpus, MAX_THREADS);
+                opt.auto_threads = true;
+                break;
+            }
+
             int value = parse_humansize(optarg);
             if (value == -EINVAL || value < 1 || value > MAX_THREADS)
                 FAIL("Invalid value for option %s: '%s' (valid range 1-%d)",
                      optname, optarg, MAX_THREADS);
 
             opt.threads = value;
+            opt.auto_threads = false;
             break;
         }
         case QUEUE_DEPTH: {
@@ -202,6 +255,36 @@ static void parse_options(int argc, char *argv[])
             opt.block_size = value;
             break;
         }
+        case RESUME:
+            opt.resume = optarg;
+            break;
+        case CHECKPOINT_INTERVAL: {
+            int64_t value = parse_humansize(optarg);
+            if (value < 0 || value > INT_MAX)
+                FAIL("Invalid value for option %s: '%s'", optname, optarg);
+
+            opt.checkpoint_interval = value;
+            break;
+        }
+        case BUSY_POLL: {
+            int64_t value = parse_humansize(optarg);
+            if (value < 0 || value > INT_MAX)
+                FAIL("Invalid value for option %s: '%s'", optname, optarg);
+
+            opt.busy_poll = value;
+            break;
+        }
+        case CPUS:
+            opt.cpus = optarg;
+            break;
+        case NUMA_NODE: {
+            int64_t value = parse_humansize(optarg);
+            if (value < 0 || value > INT_MAX)
+                FAIL("Invalid value for option %s: '%s'", optname, optarg);
+
+            opt.numa_node = value;
+            break;
+        }
         case ':':
             FAIL("Option %s requires an argument", optname);
             break;
@@ -224,10 +307,17 @@ static void parse_options(int argc, char *argv[])
         FAIL("read-size %ld is smaller than block size %ld",
              opt.read_size, opt.block_size);
 
+    if (opt.cpus && opt.numa_node != -1)
+        FAIL("Options --cpus and --numa-node cannot be used together");
+
     /* Parse arguments */
 
     if (optind < argc)
         opt.filename = argv[optind++];
+
+    /* Reading from a pipe cannot be resumed. */
+    if (opt.resume && opt.filename == NULL)
+        FAIL("Option --resume requires a filename");
 }
 
 static void handle_signal(int signum)
@@ -311,10 +401,39 @@ void list_digests(void)
     exit(0);
 }
 
+void set_hash_threads(struct blkhash_opts *ho, const struct options *opt)
+{
+    int err;
+
+    if (opt->auto_threads)
+        err = blkhash_opts_set_auto_threads(ho, 1, opt->threads);
+    else
+        err = blkhash_opts_set_threads(ho, opt->threads);
+
+    if (err)
+        FAIL("Invalid threads value: %u", opt->threads);
+}
+
+void set_hash_affinity(struct blkhash_opts *ho, const struct options *opt)
+{
+    int err;
+
+    if (opt->cpus) {
+        err = blkhash_opts_set_cpus(ho, opt->cpus);
+        if (err)
+            FAIL("Invalid cpus value: '%s': %s", opt->cpus, strerror(err));
+    } else if (opt->numa_node != -1) {
+        err = blkhash_opts_set_numa_node(ho, opt->numa_node);
+        if (err)
+            FAIL("Invalid numa node value: %d: %s", opt->numa_node,
+                 strerror(err));
+    }
+}
+
 int main(int argc, char *argv[])
 {
-    unsigned char md_value[BLKHASH_MAX_MD_SIZE];
-    unsigned int md_len;
+    unsigned char md_value[BLKHASH_MAX_DIGESTS][BLKHASH_MAX_MD_SIZE];
+    unsigned int md_len[BLKHASH_MAX_DIGESTS];
     char md_hex[BLKHASH_MAX_MD_SIZE * 2 + 1];
 
     main_thread = pthread_self();
@@ -330,11 +449,11 @@ int main(int argc, char *argv[])
 
     if (opt.filename) {
         /* TODO: remove filename parameter */
-        aio_checksum(opt.filename, &opt, md_value, &md_len);
+        aio_checksum(opt.filename, &opt, md_value, md_len);
     } else {
         struct src *s;
         s = open_pipe(STDIN_FILENO);
-        checksum(s, &opt, md_value, &md_len);
+        checksum(s, &opt, md_value, md_len);
         src_close(s);
     }
 
@@ -361,8 +480,11 @@ int main(int argc, char *argv[])
 
     pthread_mutex_unlock(&lock);
 
-    format_hex(md_value, md_len, md_hex);
-    printf("%s  %s\n", md_hex, opt.filename ? opt.filename : "-");
+    /* One line for every digest, in the order specified by --digest. */
+    for (unsigned i = 0; i < opt.digests_count; i++) {
+        format_hex(md_value[i], md_len[i], md_hex);
+        printf("%s  %s\n", md_hex, opt.filename ? opt.filename : "-");
+    }
 
     return 0;
 }
@@ -14,6 +14,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "blkhash.h"
 #include "util.h"
 
 #define PROG "blksum"
@@ -44,16 +45,23 @@ extern uint64_t started;
 struct src;
 
 struct options {
-    const char *digest_name;
+    const char *digest_names[BLKHASH_MAX_DIGESTS];
+    unsigned digests_count;
     size_t read_size;
     size_t queue_depth;
     size_t block_size;
     unsigned threads;
+    bool auto_threads;
     int64_t extents_size;
     const char *aio;
     bool cache;
     const char *filename;
     bool progress;
+    const char *resume;
+    unsigned checkpoint_interval;
+    unsigned busy_poll;
+    const char *cpus;
+    int numa_node;
     uint32_t flags;
 };
 
@@ -82,6 +90,12 @@ struct extent {
 
 void list_digests(void);
 
+/* Set the number of hash workers using --threads. */
+void set_hash_threads(struct blkhash_opts *ho, const struct options *opt);
+
+/* Set the CPUs of the hash workers using --cpus or --numa-node. */
+void set_hash_affinity(struct blkhash_opts *ho, const struct options *opt);
+
 int probe_file(const char *path, struct file_info *fi);
 
 void optimize_for_nbd_server(const char *filename, struct options *opt,
@@ -90,10 +104,14 @@ struct nbd_server *start_nbd_server(struct server_options *opt);
 char *nbd_server_uri(struct nbd_server *s);
 void stop_nbd_server(struct nbd_server *s);
 
-void checksum(struct src *s, struct options *opt, unsigned char *out,
-              unsigned int *len);
+/*
+ * Compute the checksums, storing the digest of every digest name in out and
+ * its length in len.
+ */
+void checksum(struct src *s, struct options *opt,
+              unsigned char out[][BLKHASH_MAX_MD_SIZE], unsigned int *len);
 void aio_checksum(const char *filename, struct options *opt,
-                  unsigned char *out, unsigned int *len);
+                  unsigned char out[][BLKHASH_MAX_MD_SIZE], unsigned int *len);
 
 void progress_init(int64_t size);
 void progress_update(int64_t len);
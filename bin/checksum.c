@@ -9,8 +9,8 @@
 #include "util.h"
 #include "src.h"
 
-void checksum(struct src *s, struct options *opt, unsigned char *out,
-              unsigned int *len)
+void checksum(struct src *s, struct options *opt,
+              unsigned char out[][BLKHASH_MAX_MD_SIZE], unsigned int *len)
 {
     void *buf;
     struct blkhash *h;
@@ -21,15 +21,20 @@ void checksum(struct src *s, struct options *opt, unsigned char *out,
     if (buf == NULL)
         FAIL_ERRNO("malloc");
 
-    ho = blkhash_opts_new(opt->digest_name);
+    ho = blkhash_opts_new(opt->digest_names[0]);
     if (ho == NULL)
         FAIL_ERRNO("blkhash_opts_new");
 
+    for (unsigned i = 1; i < opt->digests_count; i++) {
+        if (blkhash_opts_add_digest(ho, opt->digest_names[i]))
+            FAIL("Invalid digest name: %s", opt->digest_names[i]);
+    }
+
     if (blkhash_opts_set_block_size(ho, opt->block_size))
         FAIL("Invalid block size value: %zu", opt->block_size);
 
-    if (blkhash_opts_set_threads(ho, opt->threads))
-        FAIL("Invalid threads value: %zu", opt->threads);
+    set_hash_threads(ho, opt);
+    set_hash_affinity(ho, opt);
 
     h = blkhash_new_opts(ho);
     blkhash_opts_free(ho);
@@ -49,9 +54,17 @@ void checksum(struct src *s, struct options *opt, unsigned char *out,
     }
 
     if (running()) {
-        err = blkhash_final(h, out, len);
-        if (err)
+        err = blkhash_final(h, out[0], &len[0]);
+        if (err) {
             ERROR("blkhash_final: %s", strerror(err));
+            goto out;
+        }
+
+        for (unsigned i = 1; i < opt->digests_count; i++) {
+            err = blkhash_get_digest(h, i, out[i], &len[i]);
+            if (err)
+                FAIL("blkhash_get_digest: %s", strerror(err));
+        }
     }
 
 out:
@@ -4,13 +4,18 @@
 #ifndef BLKHASH_H
 #define BLKHASH_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 /* Maxmum length of md_value buffer for any digest name. */
 #define BLKHASH_MAX_MD_SIZE 64
 
+/* Maximum number of digests computed by one hash. */
+#define BLKHASH_MAX_DIGESTS 4
+
 struct blkhash;
 struct blkhash_opts;
+struct blkhash_pool;
 
 struct blkhash_completion {
     /* User data passed to blkhash_async_* functions. */
@@ -20,6 +25,42 @@ struct blkhash_completion {
     int error;
 };
 
+/* A data block or a run of zero blocks consumed by the hash. */
+struct blkhash_block {
+    /* The index of the first block. */
+    uint64_t index;
+
+    /* Number of blocks. Always 1 for a data block. */
+    uint64_t count;
+
+    /* The length of every block in bytes. Smaller than the block size only
+     * for the last data block of a message that is not a multiple of the
+     * block size. */
+    uint64_t len;
+
+    /* The block digest for every digest of the hash. For a run of zero
+     * blocks, the digest of one zero block. */
+    const unsigned char *md[BLKHASH_MAX_DIGESTS];
+    unsigned int md_len[BLKHASH_MAX_DIGESTS];
+
+    /* True for a run of zero blocks. */
+    bool zero;
+};
+
+/*
+ * Called for every block in order when the block digest is added to the outer
+ * digest. Return 0 on success, or errno value to fail the hash.
+ */
+typedef int (*blkhash_block_callback)(const struct blkhash_block *block,
+                                      void *user_data);
+
+/*
+ * Called when an async update completes, instead of delivering the
+ * completion using the completion fd.
+ */
+typedef void (*blkhash_completion_callback)(
+    const struct blkhash_completion *completion, void *user_data);
+
 /*
  * Allocate and initialize a block hash for creating one message digest
  * using the default options. To create a hash with non-default options
@@ -108,12 +149,35 @@ int blkhash_aio_completion_fd(struct blkhash *h);
  * became readable, and you read all pending data. The call fills in up
  * to count completions in the out array.
  *
+ * In busy poll mode, if no completion is ready, busy poll for new
+ * completions before returning. If no completion arrived, arm the
+ * completion fd so the next completion signals it. The caller must call
+ * this until it returns 0 before waiting on the completion fd.
+ *
  * Return the number of completions in the completions array on success,
  * and negative errno value on errors.
  */
 int blkhash_aio_completions(struct blkhash *h, struct blkhash_completion *out,
                             unsigned count);
 
+/*
+ * Add the next block to the hash using the block digests computed before,
+ * instead of hashing the block data. This allows rehashing only the blocks
+ * that changed since the block digests were reported by the block callback,
+ * and getting the same digest as hashing the entire image.
+ *
+ * The block must start at the current block index, after adding a multiple
+ * of block size bytes to the hash. A data block must be a full block; the
+ * last partial block must be added using blkhash_update(), since its digest
+ * does not include the length of the block. A run of zero blocks is added
+ * like blkhash_zero().
+ *
+ * Return 0 on success and errno value on error. Return EINVAL without
+ * failing the hash if the block does not match the hash. All future calls
+ * will fail after the first error.
+ */
+int blkhash_add_block(struct blkhash *h, const struct blkhash_block *block);
+
 /*
  * Finalize a hash and store the message digest in md_value.  At most
  * BLKHASH_MAX_MD_SIZE bytes will be written.
@@ -126,6 +190,101 @@ int blkhash_aio_completions(struct blkhash *h, struct blkhash_completion *out,
 int blkhash_final(struct blkhash *h, unsigned char *md_value,
                   unsigned int *md_len);
 
+/*
+ * Get the message digest at index computed by blkhash_final(). Index 0 is the
+ * digest specified in blkhash_opts_new(), and index N is the Nth digest added
+ * using blkhash_opts_add_digest(). At most BLKHASH_MAX_MD_SIZE bytes will be
+ * written. If md_len is not NULL, store the length of the digest in md_len.
+ *
+ * Return 0 on success and errno value on error. Return EINVAL if the hash was
+ * not finalized successfully or index is invalid.
+ */
+int blkhash_get_digest(struct blkhash *h, unsigned index,
+                       unsigned char *md_value, unsigned int *md_len);
+
+/*
+ * Finalize a hash created with the partial option, hashing one range of an
+ * image. Instead of a message digest, return a partial state holding the
+ * block digests and the length of the range. The partial states of
+ * adjacent ranges can be merged using blkhash_add_partial().
+ *
+ * On success buf points to the partial state and len is set to its size.
+ * The partial state is owned by the hash, and is valid until the hash is
+ * reset or freed.
+ *
+ * Return 0 on success and errno value on error. Return EINVAL if the hash
+ * was finalized or the partial option is not set.
+ */
+int blkhash_final_partial(struct blkhash *h, const void **buf, size_t *len);
+
+/*
+ * Add the partial state of the next range, created by
+ * blkhash_final_partial(), to the hash. The range must start at the current
+ * length of the hash, which must be a multiple of the block size. Only the
+ * last range may have a length that is not a multiple of the block size;
+ * after adding it the hash can only be finalized, and adding more data
+ * using blkhash_update(), blkhash_aio_update(), blkhash_zero(),
+ * blkhash_add_block() or blkhash_add_partial() fails with EINVAL.
+ *
+ * Adding the partial states of all ranges in order and finalizing the hash
+ * returns the same digest as hashing the entire image using one hash. If
+ * the hash was created with the partial option, the result is the partial
+ * state of all ranges, so partial states can be merged in any grouping.
+ *
+ * The partial state is valid only for the same library version and
+ * architecture, and for a hash with the same digests and block size.
+ *
+ * Return 0 on success and errno value on error. Return EINVAL if the
+ * partial state is invalid or does not match the hash, and EBUSY if some
+ * async updates were not reaped yet.
+ */
+int blkhash_add_partial(struct blkhash *h, const void *buf, size_t len);
+
+/*
+ * Reset a hash to its initial state, so it can be used to compute a new
+ * digest with the same options, without starting new worker threads or
+ * allocating new buffers. Can be used after blkhash_final() or after a
+ * failure. All async updates must be reaped before resetting the hash,
+ * unless the hash has failed.
+ *
+ * Return 0 on success and errno value on error. Return EBUSY if some async
+ * updates were not reaped yet.
+ */
+int blkhash_reset(struct blkhash *h);
+
+/*
+ * Save the state of a hash to buf, so hashing can be resumed later using
+ * blkhash_load_state(), possibly in another process. The state includes
+ * the outer digests states, the current block index, the message length,
+ * and the pending partial block. All async updates must be reaped before
+ * saving the state.
+ *
+ * On input len is the size of buf. On success len is set to the size of
+ * the state. If buf is NULL, len is set to the maximum size of the state.
+ *
+ * The state is valid only for the same library version and architecture,
+ * and for a hash with the same digests and block size.
+ *
+ * Return 0 on success and errno value on error. Return ERANGE if buf is too
+ * small, EBUSY if some async updates were not reaped yet, and ENOTSUP if
+ * the hash was not created with the resumable option, or the state of one
+ * of the digests cannot be saved.
+ */
+int blkhash_save_state(struct blkhash *h, void *buf, size_t *len);
+
+/*
+ * Reset the hash and load the state saved by blkhash_save_state(). Hashing
+ * continues from the point the state was saved, and blkhash_final() returns
+ * the same digest as hashing all the data using one hash.
+ *
+ * Return 0 on success and errno value on error. Return EINVAL if the state
+ * is invalid or does not match the hash configuration, or the hash was
+ * created with the partial option, and ENOTSUP if the hash was not created
+ * with the resumable option, or the state of one of the digests cannot be
+ * loaded.
+ */
+int blkhash_load_state(struct blkhash *h, const void *buf, size_t len);
+
 /*
  * Free resources allocated in blkhash_new().
  */
@@ -148,6 +307,18 @@ size_t blkhash_digests(const char **names, size_t count);
  */
 struct blkhash_opts *blkhash_opts_new(const char *digest_name);
 
+/*
+ * Add another digest computed in the same pass over the data. Every block is
+ * hashed with all digests by the same worker while the data is in the cache,
+ * and a separate outer digest is computed for every digest. blkhash_final()
+ * returns the first digest; use blkhash_get_digest() to get the other
+ * digests.
+ *
+ * Return EINVAL if the value is invalid or if BLKHASH_MAX_DIGESTS digests were
+ * already added.
+ */
+int blkhash_opts_add_digest(struct blkhash_opts *o, const char *digest_name);
+
 /*
  * Set the hash block size. The size should be power of 2, and your
  * buffer passed to blkhash_upodate() should be a multiple of this size.
@@ -166,6 +337,20 @@ int blkhash_opts_set_block_size(struct blkhash_opts *o, uint32_t block_size);
  */
 int blkhash_opts_set_threads(struct blkhash_opts *o, uint8_t threads);
 
+/*
+ * Start max_threads worker threads, but use only the number of threads
+ * needed for the current load, between min_threads and max_threads. The
+ * hash starts with min_threads active threads, adds threads when the
+ * workers cannot keep up with the caller, and removes threads when the
+ * caller cannot keep the workers busy. Useful when the data source
+ * throughput is not known. Not used with a shared pool. Changing this value
+ * does not change the hash value.
+ *
+ * Return EINVAL if the values are invalid.
+ */
+int blkhash_opts_set_auto_threads(struct blkhash_opts *o, uint8_t min_threads,
+                                  uint8_t max_threads);
+
 /*
  * Set the maximum number of inflight async updates supported by the
  * hash and enable the async API. If not set, the async APIs will fail
@@ -176,7 +361,120 @@ int blkhash_opts_set_threads(struct blkhash_opts *o, uint8_t threads);
 int blkhash_opts_set_queue_depth(struct blkhash_opts *o, unsigned queue_depth);
 
 /*
- * Return the digest name.
+ * Avoid copying data in blkhash_update(). When enabled, the workers hash
+ * the caller buffer directly, and blkhash_update() returns only when all
+ * blocks in the buffer were hashed. This avoids copying the data, at the
+ * cost of waiting for the workers on every call. Changing this value does
+ * not change the hash value.
+ *
+ * Return EINVAL if the value is invalid.
+ */
+int blkhash_opts_set_zero_copy(struct blkhash_opts *o, bool zero_copy);
+
+/*
+ * Use a worker pool shared by multiple hashes instead of creating worker
+ * threads for this hash. The threads option is ignored when using a shared
+ * pool. The pool must not be freed before the hash. Changing this value does
+ * not change the hash value.
+ *
+ * Return EINVAL if the value is invalid.
+ */
+int blkhash_opts_set_pool(struct blkhash_opts *o, struct blkhash_pool *pool);
+
+/*
+ * Call callback with user_data for every data block and every run of zero
+ * blocks, in order. Consecutive zero blocks are reported as one run. The
+ * callback is called from the thread calling blkhash_update(),
+ * blkhash_aio_update(), blkhash_zero() or blkhash_final(), and the block
+ * digests are valid only during the call. Changing this value does not
+ * change the hash value.
+ *
+ * Return EINVAL if the value is invalid.
+ */
+int blkhash_opts_set_block_callback(struct blkhash_opts *o,
+                                    blkhash_block_callback callback,
+                                    void *user_data);
+
+/*
+ * Hash a range of an image, collecting the block digests for
+ * blkhash_final_partial() instead of computing a message digest. This
+ * allows hashing ranges of a huge image in parallel, in multiple threads,
+ * processes or hosts, and merging the partial states using
+ * blkhash_add_partial(). The partial state holds one block digest per data
+ * block and one entry per run of zero blocks.
+ *
+ * Return EINVAL if the value is invalid.
+ */
+int blkhash_opts_set_partial(struct blkhash_opts *o, bool partial);
+
+/*
+ * Compute the outer digests using digests supporting blkhash_save_state()
+ * and blkhash_load_state(). For SHA digests this uses the OpenSSL low level
+ * APIs, deprecated since OpenSSL 3.0. Without this option saving and
+ * loading the state fail with ENOTSUP. Changing this value does not change
+ * the hash value.
+ *
+ * Return EINVAL if the value is invalid.
+ */
+int blkhash_opts_set_resumable(struct blkhash_opts *o, bool resumable);
+
+/*
+ * Call callback with user_data when an async update completes, instead of
+ * delivering the completion using the completion fd and
+ * blkhash_aio_completions(). The callback is called on the worker thread
+ * completing the last block of the update, or on the thread calling
+ * blkhash_aio_update() if the update was completed before the call
+ * returned. The callback must not call blkhash functions, and should only
+ * pass the completion to the application, for example using a thread safe
+ * queue. Requires setting the queue depth.
+ *
+ * When using a completion callback, blkhash_aio_completion_fd() and
+ * blkhash_aio_completions() fail with ENOTSUP. Changing this value does not
+ * change the hash value.
+ *
+ * Return EINVAL if the value is invalid.
+ */
+int blkhash_opts_set_completion_callback(struct blkhash_opts *o,
+                                         blkhash_completion_callback callback,
+                                         void *user_data);
+
+/*
+ * Enable busy poll mode, reducing the number of system calls for delivering
+ * async completions. In this mode, blkhash_aio_completions() busy polls for
+ * up to usec microseconds for completions published by the workers, and the
+ * completion fd is signaled only after blkhash_aio_completions() returned no
+ * completions. This is useful when the source is very fast, at the cost of
+ * using more CPU time in the caller thread. The default (0) disables busy
+ * polling. Changing this value does not change the hash value.
+ *
+ * Return EINVAL if the value is invalid.
+ */
+int blkhash_opts_set_busy_poll(struct blkhash_opts *o, unsigned usec);
+
+/*
+ * Run the hash worker threads on the CPUs in cpus, a list like "0-7,16-23"
+ * using the same format as taskset -c. The copy buffers are allocated
+ * when creating the hash, on the NUMA node of these CPUs. NULL clears the
+ * CPU set, letting workers run on any CPU. Not used with a shared pool.
+ * Changing this value does not change the hash value.
+ *
+ * Return EINVAL if the value is invalid, and ENOTSUP if thread affinity is
+ * not supported on this platform.
+ */
+int blkhash_opts_set_cpus(struct blkhash_opts *o, const char *cpus);
+
+/*
+ * Run the hash worker threads on the CPUs of NUMA node, and allocate the
+ * copy buffers on this node. Same as blkhash_opts_set_cpus() with the CPUs
+ * of the node. -1 clears the CPU set.
+ *
+ * Return EINVAL if the node does not exist or has no CPUs, and ENOTSUP if
+ * NUMA information is not available.
+ */
+int blkhash_opts_set_numa_node(struct blkhash_opts *o, int node);
+
+/*
+ * Return the digest name specified in blkhash_opts_new().
  */
 const char *blkhash_opts_get_digest_name(struct blkhash_opts *o);
 
@@ -190,15 +488,59 @@ uint32_t blkhash_opts_get_block_size(struct blkhash_opts *o);
  */
 uint8_t blkhash_opts_get_threads(struct blkhash_opts *o);
 
+/*
+ * Return the minimal number of threads, the same as the number of threads
+ * unless blkhash_opts_set_auto_threads() was used.
+ */
+uint8_t blkhash_opts_get_min_threads(struct blkhash_opts *o);
+
 /*
  * Return the maximum number of inflight async updates supported by the
  * hash.
  */
 unsigned blkhash_opts_get_queue_depth(struct blkhash_opts *o);
 
+/*
+ * Return true if blkhash_update() does not copy data.
+ */
+bool blkhash_opts_get_zero_copy(struct blkhash_opts *o);
+
+/*
+ * Return the busy poll period in microseconds, or 0 if busy poll mode is
+ * disabled.
+ */
+unsigned blkhash_opts_get_busy_poll(struct blkhash_opts *o);
+
+/*
+ * Return the shared pool, or NULL if the hash uses its own threads.
+ */
+struct blkhash_pool *blkhash_opts_get_pool(struct blkhash_opts *o);
+
 /*
  * Free resource allocated in blkhash_opts_new().
  */
 void blkhash_opts_free(struct blkhash_opts *o);
 
+/*
+ * Allocate a worker pool with the specified number of threads, for sharing
+ * by multiple hashes. Hashes using the pool submit blocks to the same
+ * workers, avoiding creating and destroying threads for every hash, and
+ * oversubscribing the CPUs when hashing many images concurrently. Every
+ * hash has a bounded number of blocks in the pool, but the workers are not
+ * divided fairly between hashes; a hash submitting many blocks may delay
+ * other hashes. See blkhash_opts_set_pool().
+ *
+ * The pool can be used concurrently by hashes in different threads. Free the
+ * pool using blkhash_pool_free() after freeing all hashes using it.
+ *
+ * Return NULL and set errno on error.
+ */
+struct blkhash_pool *blkhash_pool_new(uint8_t threads);
+
+/*
+ * Stop the pool threads and free the resources allocated in
+ * blkhash_pool_new().
+ */
+void blkhash_pool_free(struct blkhash_pool *pool);
+
 #endif /* BLKHASH_H */
@@ -0,0 +1,189 @@
+// SPDX-FileCopyrightText: Red Hat Inc
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#define _GNU_SOURCE     /* For pthread_attr_setaffinity_np */
+
+#include <ctype.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "affinity.h"
+
+#define NODE_CPULIST "/sys/devices/system/node/node%d/cpulist"
+
+static inline void mask_set(struct cpu_mask *m, unsigned cpu)
+{
+    m->bits[cpu / 64] |= UINT64_C(1) << (cpu % 64);
+}
+
+static inline bool mask_isset(const struct cpu_mask *m, unsigned cpu)
+{
+    return m->bits[cpu / 64] & (UINT64_C(1) << (cpu % 64));
+}
+
+static int parse_cpu(const char *s, char **end, unsigned long *cpu)
+{
+    /* strtoul() accepts leading whitespace and a sign. */
+    if (!isdigit((unsigned char)*s))
+        return EINVAL;
+
+    errno = 0;
+    *cpu = strtoul(s, end, 10);
+    if (errno || *cpu >= MAX_CPUS)
+        return EINVAL;
+
+    return 0;
+}
+
+int cpu_mask_parse(struct cpu_mask *m, const char *list)
+{
+    struct cpu_mask tmp = {{0}};
+    const char *p = list;
+
+    for (;;) {
+        unsigned long first, last;
+        char *end;
+
+        if (parse_cpu(p, &end, &first))
+            return EINVAL;
+
+        last = first;
+        if (*end == '-' && parse_cpu(end + 1, &end, &last))
+            return EINVAL;
+
+        if (first > last)
+            return EINVAL;
+
+        for (unsigned long cpu = first; cpu <= last; cpu++)
+            mask_set(&tmp, cpu);
+
+        if (*end == '\0')
+            break;
+
+        if (*end != ',')
+            return EINVAL;
+
+        p = end + 1;
+    }
+
+    *m = tmp;
+    return 0;
+}
+
+int cpu_mask_numa_node(struct cpu_mask *m, int node)
+{
+    char path[64];
+    char list[4096];
+    size_t len;
+    FILE *f;
+
+    if (node < 0)
+        return EINVAL;
+
+    snprintf(path, sizeof(path), NODE_CPULIST, node);
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        if (errno != ENOENT)
+            return errno;
+
+        /* No NUMA support, or the node does not exist. */
+        if (access("/sys/devices/system/node", F_OK) != 0)
+            return ENOTSUP;
+
+        return EINVAL;
+    }
+
+    if (fgets(list, sizeof(list), f) == NULL)
+        list[0] = '\0';
+
+    fclose(f);
+
+    len = strlen(list);
+    if (len > 0 && list[len - 1] == '\n')
+        list[--len] = '\0';
+
+    /* A memory only node has no CPUs. */
+    if (len == 0)
+        return EINVAL;
+
+    return cpu_mask_parse(m, list);
+}
+
+bool cpu_mask_empty(const struct cpu_mask *m)
+{
+    for (unsigned i = 0; i < MAX_CPUS / 64; i++) {
+        if (m->bits[i])
+            return false;
+    }
+
+    return true;
+}
+
+#ifdef __linux__
+
+static int set_affinity(pthread_attr_t *attr, const struct cpu_mask *m)
+{
+    cpu_set_t set;
+
+    _Static_assert(MAX_CPUS <= CPU_SETSIZE, "MAX_CPUS is too large");
+
+    CPU_ZERO(&set);
+    for (unsigned cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (mask_isset(m, cpu))
+            CPU_SET(cpu, &set);
+    }
+
+    return pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+
+#else
+
+static int set_affinity(pthread_attr_t *attr, const struct cpu_mask *m)
+{
+    (void)attr;
+    (void)m;
+
+    return ENOTSUP;
+}
+
+#endif
+
+int cpu_mask_thread_create(pthread_t *thread, const struct cpu_mask *m,
+                           void *(*fn)(void *), void *arg)
+{
+    pthread_attr_t attr;
+    int err;
+
+    if (m == NULL || cpu_mask_empty(m))
+        return pthread_create(thread, NULL, fn, arg);
+
+    err = pthread_attr_init(&attr);
+    if (err)
+        return err;
+
+    err = set_affinity(&attr, m);
+    if (err == 0)
+        err = pthread_create(thread, &attr, fn, arg);
+
+    pthread_attr_destroy(&attr);
+
+    return err;
+}
+
+int cpu_mask_run(const struct cpu_mask *m, void *(*fn)(void *), void *arg,
+                 void **ret)
+{
+    pthread_t thread;
+    int err;
+
+    err = cpu_mask_thread_create(&thread, m, fn, arg);
+    if (err)
+        return err;
+
+    return pthread_join(thread, ret);
+}
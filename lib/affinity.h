@@ -0,0 +1,52 @@
+// SPDX-FileCopyrightText: Red Hat Inc
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Same as CPU_SETSIZE in glibc. */
+#define MAX_CPUS 1024
+
+/*
+ * A set of CPUs for running worker threads. An empty mask means no affinity;
+ * threads may run on any CPU.
+ */
+struct cpu_mask {
+    uint64_t bits[MAX_CPUS / 64];
+};
+
+/*
+ * Parse a CPU list like "0-3,8,10-11", using the same format as taskset -c
+ * and the NUMA node cpulist files in sysfs. Return 0 on success and errno
+ * value on errors.
+ */
+int cpu_mask_parse(struct cpu_mask *m, const char *list);
+
+/*
+ * Set the mask to the CPUs of NUMA node. Return EINVAL if the node does not
+ * exist or has no CPUs, and ENOTSUP if NUMA information is not available.
+ */
+int cpu_mask_numa_node(struct cpu_mask *m, int node);
+
+bool cpu_mask_empty(const struct cpu_mask *m);
+
+/*
+ * Create a thread running on the CPUs in mask. If mask is NULL or empty,
+ * create a thread without affinity.
+ */
+int cpu_mask_thread_create(pthread_t *thread, const struct cpu_mask *m,
+                           void *(*fn)(void *), void *arg);
+
+/*
+ * Run fn on a thread running on the CPUs in mask and wait until it returns.
+ * Used to allocate memory on the NUMA node of these CPUs, since the kernel
+ * places pages on the node of the thread touching them first.
+ */
+int cpu_mask_run(const struct cpu_mask *m, void *(*fn)(void *), void *arg,
+                 void **ret);
+
+#endif /* AFFINITY_H */
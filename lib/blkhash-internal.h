@@ -10,6 +10,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "affinity.h"
 #include "blkhash-config.h"
 #include "blkhash.h"
 
@@ -19,42 +20,134 @@
 } while (0)
 
 struct blkhash_opts {
-    const char *digest_name;
+    const char *digest_names[BLKHASH_MAX_DIGESTS];
+    unsigned digests_count;
     uint32_t block_size;
     unsigned queue_depth;
     uint8_t threads;
+    uint8_t min_threads;
+    bool zero_copy;
+    struct blkhash_pool *pool;
+    blkhash_block_callback block_callback;
+    void *block_callback_data;
+    bool partial;
+    bool resumable;
+    unsigned busy_poll;
+    blkhash_completion_callback completion_callback;
+    void *completion_callback_data;
+    struct cpu_mask cpus;
 };
 
-struct config {
+struct config_digest {
     unsigned char zero_md[BLKHASH_MAX_MD_SIZE];
-    const char *digest_name;
-    uint32_t block_size;
+    const char *name;
     unsigned md_len;
+};
+
+struct config {
+    struct config_digest digests[BLKHASH_MAX_DIGESTS];
+    unsigned digests_count;
+    uint32_t block_size;
     unsigned workers;
+    unsigned min_workers;
     unsigned queue_depth;
     unsigned max_submissions;
+    bool zero_copy;
+    struct cpu_mask cpus;
 
     /* Align to avoid false sharing between workers. */
 } __attribute__ ((aligned (CACHE_LINE_SIZE)));
 
+/* Time spent by the caller waiting for submissions. */
+struct wait_stats {
+    /* Waits completed while spinning, and the time spent spinning. */
+    uint64_t spins;
+    uint64_t spin_usec;
+
+    /* Waits that had to sleep, and the time spent spinning and sleeping. */
+    uint64_t sleeps;
+    uint64_t sleep_usec;
+};
+
+/*
+ * Copy the time the caller waited for the workers since the hash was
+ * created. For tests and benchmarks.
+ */
+void blkhash_get_wait_stats(struct blkhash *h, struct wait_stats *out);
+
 typedef void (*completion_callback)(struct blkhash *h, void *user_data, int error);
 
+struct completion_pool;
+
 struct completion {
     completion_callback callback;
     struct blkhash *hash;
     void *user_data;
     int error;
     unsigned refs;
+
+    /* The pool owning this completion. */
+    struct completion_pool *pool;
+
+    /* Next free completion in the pool. */
+    struct completion *next;
+
+    /* Align to avoid false sharing between workers completing different
+     * updates. */
+} __attribute__ ((aligned (CACHE_LINE_SIZE)));
+
+/*
+ * Preallocated completions for async updates. Completions are taken by the
+ * caller thread and released by the thread dropping the last reference,
+ * usually a worker. Released completions are pushed atomically to the
+ * released list, and the caller takes the entire list when its own free list
+ * is empty, so taking and releasing never use a lock or malloc.
+ */
+struct completion_pool {
+    struct completion *array;
+
+    /* Free completions, accessed only by the caller thread. */
+    struct completion *free;
+
+    unsigned size;
+
+    /* Completions released by other threads, modified atomically. */
+    struct completion *released __attribute__ ((aligned (CACHE_LINE_SIZE)));
 };
 
 int config_init(struct config *c, const struct blkhash_opts *opts);
 
-struct completion *completion_new(completion_callback cb, struct blkhash *hash,
-                                  void *user_data);
+int completion_pool_init(struct completion_pool *p, unsigned size);
+void completion_pool_destroy(struct completion_pool *p);
+
+/*
+ * Take a completion from the pool. The completion is returned to the pool
+ * before calling the callback, so the callback may free the pool.
+ */
+int completion_new(struct completion_pool *p, completion_callback cb,
+                   struct blkhash *hash, void *user_data,
+                   struct completion **out);
 void completion_set_error(struct completion *c, int error);
 void completion_ref(struct completion *c);
 void completion_unref(struct completion *c);
 
 bool is_zero(const void *buf, size_t len);
 
+/*
+ * Copy len bytes from src to dst unless src is zero, reading src once.
+ * Return true if src is zero and nothing was copied.
+ */
+bool copy_unless_zero(void *dst, const void *src, size_t len);
+
+struct zero_variant {
+    const char *name;
+    bool (*is_zero)(const void *buf, size_t len);
+};
+
+/*
+ * Return the is_zero() variants supported on this CPU, ordered from slowest
+ * to fastest. is_zero() uses the fastest variant.
+ */
+unsigned zero_variants(const struct zero_variant **variants);
+
 #endif /* BLKHASH_INTERNAL_H */
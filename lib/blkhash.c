@@ -24,36 +24,186 @@
 /* Allow large number for testing. */
 #define MAX_THREADS 128
 
+/* Number of CPU relax hints between checks when busy polling. */
+#define BUSY_POLL_RELAX 64
+
+/* Number of submissions queued for every worker in a shared pool. */
+#define SHARED_QUEUE_SIZE 1024
+
+/* Size of the buffers for adding block digests to the outer digests, large
+ * enough to amortize the cost of digest_update() over many block digests. */
+#define OUTER_BUFFER_SIZE (8 * KiB)
+
 struct buffer {
     unsigned char *data;
     size_t len;
     bool zero;
 };
 
-/* Used if queue_depth > 0 for blkhash_aio_update calls. accessed both by
- * worker threads and caller threads. */
+struct completion_slot {
+    uint64_t seq;
+    struct blkhash_completion completion;
+};
+
+/*
+ * Used if queue_depth > 0 for blkhash_aio_update calls. Completions are
+ * pushed by worker threads and popped by the caller thread, using a bounded
+ * lock-free ring like struct ring, simplified for a single consumer. The ring
+ * can hold queue_depth completions, so pushing never fails.
+ */
 struct completion_queue {
-    pthread_mutex_t mutex;
-    struct blkhash_completion *array;
+    /* Modified only by the caller thread. */
+    uint64_t head __attribute__ ((aligned (CACHE_LINE_SIZE)));
+
+    /* Modified by worker threads. */
+    uint64_t tail __attribute__ ((aligned (CACHE_LINE_SIZE)));
+
+    /* In busy poll mode, set by the caller thread before waiting on the
+     * event, and cleared by the worker signaling the event. */
+    bool armed __attribute__ ((aligned (CACHE_LINE_SIZE)));
+
+    /* Read only after initialization. */
+    struct completion_slot *slots __attribute__ ((aligned (CACHE_LINE_SIZE)));
+    uint64_t mask;
     struct event *event;
-    unsigned count;
+
+    /* Microseconds to busy poll before arming the event, 0 to signal the
+     * event for every batch of completions. */
+    unsigned busy_poll;
 } __attribute__ ((aligned (CACHE_LINE_SIZE)));
 
+/* Buffers for adding block digests to one outer digest in large chunks. */
+struct outer_buffers {
+    /* Block digests not added to the outer digest yet. */
+    unsigned char *staged;
+    unsigned staged_len;
+
+    /* The zero block digest repeated, for adding runs of zero blocks. */
+    unsigned char *zeros;
+    unsigned zeros_len;
+};
+
+/* Identifies a state saved by blkhash_save_state(). */
+#define STATE_MAGIC "BLKHASH1"
+
+#define STATE_NAME_SIZE 32
+
+/*
+ * The header of a saved state, followed by the pending data and the outer
+ * digests states. Uses native byte order; the state can be loaded only on
+ * the same architecture.
+ */
+struct saved_state {
+    char magic[8];
+    uint32_t block_size;
+    uint32_t digests_count;
+    char digest_names[BLKHASH_MAX_DIGESTS][STATE_NAME_SIZE];
+    uint32_t state_sizes[BLKHASH_MAX_DIGESTS];
+    uint32_t pending_len;
+    uint32_t pending_zero;
+    int64_t block_index;
+    int64_t submitted_index;
+    int64_t hashed_index;
+    int64_t zero_run_index;
+    uint64_t zero_run_count;
+    uint64_t message_length;
+};
+
+/* Identifies a partial state created by blkhash_final_partial(). */
+#define PARTIAL_MAGIC "BLKPART1"
+
+/*
+ * The header of a partial state, followed by entries for runs of data or
+ * zero blocks. Uses native byte order like the saved state.
+ */
+struct partial_header {
+    char magic[8];
+    uint32_t block_size;
+    uint32_t digests_count;
+    char digest_names[BLKHASH_MAX_DIGESTS][STATE_NAME_SIZE];
+    uint64_t message_length;
+};
+
+/*
+ * A run of count zero blocks, or count data blocks followed by the block
+ * digests of every block, one digest after another.
+ */
+struct partial_entry {
+    uint64_t count;
+    uint32_t zero;
+    uint32_t padding;
+};
+
+/* The partial state collected when using the partial option. */
+struct partial_stream {
+    unsigned char *data;
+    size_t len;
+    size_t capacity;
+
+    /* The offset of the last entry, or 0 if there are no entries. */
+    size_t last;
+};
+
+/* Pool shared by multiple hashes. */
+struct blkhash_pool {
+    struct hash_pool pool;
+};
+
 struct blkhash {
     struct config config;
 
-    /* For computing block hashes. */
-    struct hash_pool pool;
+    /* For computing block hashes. Points to our own pool, or to the pool
+     * shared by multiple hashes. */
+    struct hash_pool *pool;
+
+    /* Used if no shared pool was specified. */
+    struct hash_pool own_pool;
+
+    /* Preallocated submissions and copy buffers. */
+    struct submission_arena arena;
 
     struct submission_queue sq;
     struct completion_queue cq;
 
+    /* Preallocated completions for async updates. */
+    struct completion_pool completions;
+
+    /* Data submissions queued in sq but not sent to the hash pool yet. All
+     * full blocks of one update are submitted together. */
+    struct submission **batch;
+    unsigned batch_len;
+
     /* For keeping partial blocks when user call blkhash_update() with buffer
      * that is not aligned to block size. */
     struct buffer pending;
 
-    /* For computing outer digest from block hashes. */
-    struct digest *outer_digest;
+    /* For computing outer digests from block hashes, one for every
+     * digest of the hash. */
+    struct digest *outer_digests[BLKHASH_MAX_DIGESTS];
+    struct outer_buffers outer_buffers[BLKHASH_MAX_DIGESTS];
+
+    /* The outer digests values, set when the hash is finalized
+     * successfully. */
+    unsigned char md_values[BLKHASH_MAX_DIGESTS][BLKHASH_MAX_MD_SIZE];
+    unsigned md_lens[BLKHASH_MAX_DIGESTS];
+    bool have_md_values;
+
+    /* Called for every data block and every run of zero blocks. */
+    blkhash_block_callback block_callback;
+    void *block_callback_data;
+
+    /* Set if the block digests are collected for blkhash_final_partial()
+     * instead of adding them to the outer digests. */
+    bool partial;
+    struct partial_stream partial_stream;
+
+    /* Set if the outer digests support saving and loading the state. */
+    bool resumable;
+
+    /* The zero blocks added to the outer digests and not reported to the
+     * block callback yet. */
+    int64_t zero_run_index;
+    uint64_t zero_run_count;
 
     /* Current block index, increased when consuming a data or zero block. */
     int64_t block_index;
@@ -67,10 +217,15 @@ struct blkhash {
     /* Message length incremented on each update or zero. */
     uint64_t message_length;
 
+    /* Called when an async update completes, instead of using the
+     * completion queue. */
+    blkhash_completion_callback completion_callback;
+    void *completion_callback_data;
+
     /*
      * Number of updates started and not reaped yet. Increased when submitting
-     * an async update, and decreased when reaping completions. Modified only
-     * by the caller thread.
+     * an async update, and decreased when reaping completions, or by the
+     * workers when using a completion callback. Modified atomically.
      */
     unsigned inflight;
 
@@ -83,10 +238,21 @@ struct blkhash {
 };
 
 static const struct blkhash_opts default_opts = {
-    .digest_name = "sha256",
+    .digest_names = {"sha256"},
+    .digests_count = 1,
     .block_size = 64 * KiB,
     .threads = 4,
+    .min_threads = 4,
     .queue_depth = 0,
+    .zero_copy = false,
+    .pool = NULL,
+    .block_callback = NULL,
+    .block_callback_data = NULL,
+    .partial = false,
+    .resumable = false,
+    .busy_poll = 0,
+    .completion_callback = NULL,
+    .completion_callback_data = NULL,
 };
 
 struct blkhash_opts *blkhash_opts_new(const char *digest_name)
@@ -101,11 +267,20 @@ struct blkhash_opts *blkhash_opts_new(const char *digest_name)
         return NULL;
 
     memcpy(o, &default_opts, sizeof(*o));
-    o->digest_name = digest_name;
+    o->digest_names[0] = digest_name;
 
     return o;
 }
 
+int blkhash_opts_add_digest(struct blkhash_opts *o, const char *digest_name)
+{
+    if (digest_name == NULL || o->digests_count == BLKHASH_MAX_DIGESTS)
+        return EINVAL;
+
+    o->digest_names[o->digests_count++] = digest_name;
+    return 0;
+}
+
 int blkhash_opts_set_block_size(struct blkhash_opts *o, uint32_t block_size)
 {
     if (block_size % 2)
@@ -121,6 +296,19 @@ int blkhash_opts_set_threads(struct blkhash_opts *o, uint8_t threads)
         return EINVAL;
 
     o->threads = threads;
+    o->min_threads = threads;
+    return 0;
+}
+
+int blkhash_opts_set_auto_threads(struct blkhash_opts *o, uint8_t min_threads,
+                                  uint8_t max_threads)
+{
+    if (min_threads < 1 || min_threads > max_threads ||
+        max_threads > MAX_THREADS)
+        return EINVAL;
+
+    o->threads = max_threads;
+    o->min_threads = min_threads;
     return 0;
 }
 
@@ -130,9 +318,81 @@ int blkhash_opts_set_queue_depth(struct blkhash_opts *o, unsigned queue_depth)
     return 0;
 }
 
+int blkhash_opts_set_zero_copy(struct blkhash_opts *o, bool zero_copy)
+{
+    o->zero_copy = zero_copy;
+    return 0;
+}
+
+int blkhash_opts_set_pool(struct blkhash_opts *o, struct blkhash_pool *pool)
+{
+    o->pool = pool;
+    return 0;
+}
+
+int blkhash_opts_set_block_callback(struct blkhash_opts *o,
+                                    blkhash_block_callback callback,
+                                    void *user_data)
+{
+    o->block_callback = callback;
+    o->block_callback_data = user_data;
+    return 0;
+}
+
+int blkhash_opts_set_partial(struct blkhash_opts *o, bool partial)
+{
+    o->partial = partial;
+    return 0;
+}
+
+int blkhash_opts_set_resumable(struct blkhash_opts *o, bool resumable)
+{
+    o->resumable = resumable;
+    return 0;
+}
+
+int blkhash_opts_set_completion_callback(struct blkhash_opts *o,
+                                         blkhash_completion_callback callback,
+                                         void *user_data)
+{
+    o->completion_callback = callback;
+    o->completion_callback_data = user_data;
+    return 0;
+}
+
+int blkhash_opts_set_busy_poll(struct blkhash_opts *o, unsigned usec)
+{
+    o->busy_poll = usec;
+    return 0;
+}
+
+int blkhash_opts_set_cpus(struct blkhash_opts *o, const char *cpus)
+{
+    if (cpus == NULL) {
+        memset(&o->cpus, 0, sizeof(o->cpus));
+        return 0;
+    }
+
+#ifdef __linux__
+    return cpu_mask_parse(&o->cpus, cpus);
+#else
+    return ENOTSUP;
+#endif
+}
+
+int blkhash_opts_set_numa_node(struct blkhash_opts *o, int node)
+{
+    if (node == -1) {
+        memset(&o->cpus, 0, sizeof(o->cpus));
+        return 0;
+    }
+
+    return cpu_mask_numa_node(&o->cpus, node);
+}
+
 const char *blkhash_opts_get_digest_name(struct blkhash_opts *o)
 {
-    return o->digest_name;
+    return o->digest_names[0];
 }
 
 uint32_t blkhash_opts_get_block_size(struct blkhash_opts *o)
@@ -145,16 +405,71 @@ uint8_t blkhash_opts_get_threads(struct blkhash_opts *o)
     return o->threads;
 }
 
+uint8_t blkhash_opts_get_min_threads(struct blkhash_opts *o)
+{
+    return o->min_threads;
+}
+
 unsigned blkhash_opts_get_queue_depth(struct blkhash_opts *o)
 {
     return o->queue_depth;
 }
 
+bool blkhash_opts_get_zero_copy(struct blkhash_opts *o)
+{
+    return o->zero_copy;
+}
+
+unsigned blkhash_opts_get_busy_poll(struct blkhash_opts *o)
+{
+    return o->busy_poll;
+}
+
+struct blkhash_pool *blkhash_opts_get_pool(struct blkhash_opts *o)
+{
+    return o->pool;
+}
+
 void blkhash_opts_free(struct blkhash_opts *o)
 {
     free(o);
 }
 
+struct blkhash_pool *blkhash_pool_new(uint8_t threads)
+{
+    struct blkhash_pool *bp;
+    int err;
+
+    if (threads < 1 || threads > MAX_THREADS) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    err = posix_memalign((void **)&bp, CACHE_LINE_SIZE, sizeof(*bp));
+    if (err) {
+        errno = err;
+        return NULL;
+    }
+
+    err = hash_pool_init(&bp->pool, threads, SHARED_QUEUE_SIZE, NULL);
+    if (err) {
+        free(bp);
+        errno = err;
+        return NULL;
+    }
+
+    return bp;
+}
+
+void blkhash_pool_free(struct blkhash_pool *bp)
+{
+    if (bp == NULL)
+        return;
+
+    hash_pool_destroy(&bp->pool);
+    free(bp);
+}
+
 /* Set the error and return -1. All intenral errors should be handled with
  * this. Public APIs should always return the internal error on failures. */
 static inline int set_error(struct blkhash *h, int error)
@@ -165,6 +480,195 @@ static inline int set_error(struct blkhash *h, int error)
     return -1;
 }
 
+static int init_outer_buffers(struct outer_buffers *b,
+                              const struct config_digest *d)
+{
+    b->staged = malloc(OUTER_BUFFER_SIZE * 2);
+    if (b->staged == NULL)
+        return errno;
+
+    b->zeros = b->staged + OUTER_BUFFER_SIZE;
+    b->zeros_len = 0;
+
+    /* The null digest has empty block digests. */
+    if (d->md_len > 0) {
+        while (b->zeros_len + d->md_len <= OUTER_BUFFER_SIZE) {
+            memcpy(b->zeros + b->zeros_len, d->zero_md, d->md_len);
+            b->zeros_len += d->md_len;
+        }
+    }
+
+    return 0;
+}
+
+static int init_completion_queue(struct completion_queue *cq, unsigned size,
+                                 unsigned busy_poll)
+{
+    uint64_t capacity = 1;
+
+    while (capacity < size)
+        capacity <<= 1;
+
+    cq->slots = malloc(capacity * sizeof(*cq->slots));
+    if (cq->slots == NULL)
+        return errno;
+
+    /* Slot i is ready for the producer at position i. */
+    for (uint64_t i = 0; i < capacity; i++)
+        cq->slots[i].seq = i;
+
+    cq->mask = capacity - 1;
+    cq->head = 0;
+    cq->tail = 0;
+    cq->busy_poll = busy_poll;
+
+    /* The first completion signals the event. */
+    cq->armed = true;
+
+    return 0;
+}
+
+/*
+ * Push a completion from a worker thread. Return true if the queue was empty,
+ * and the caller thread must be notified.
+ */
+static bool push_completion(struct completion_queue *cq, void *user_data,
+                            int error)
+{
+    struct completion_slot *slot;
+    uint64_t pos = __atomic_load_n(&cq->tail, __ATOMIC_RELAXED);
+
+    for (;;) {
+        slot = &cq->slots[pos & cq->mask];
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)(seq - pos);
+
+        /* Cannot be full since we have at most queue_depth inflight
+         * updates. */
+        assert(diff >= 0);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&cq->tail, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else {
+            /* Another worker took this slot. */
+            pos = __atomic_load_n(&cq->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->completion.user_data = user_data;
+    slot->completion.error = error;
+
+    /*
+     * Publish the completion and check if the caller already consumed all
+     * previous completions. Sequentially consistent ordering pairs with
+     * pop_completions(), ensuring that either the caller sees our
+     * completion, or we see that the queue was empty. Both may happen,
+     * causing a spurious notification.
+     */
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+
+    return __atomic_load_n(&cq->head, __ATOMIC_SEQ_CST) == pos;
+}
+
+/*
+ * Pop up to count completions in the caller thread. Return the number of
+ * completions, and set have_more if more completions are ready.
+ */
+static unsigned pop_completions(struct completion_queue *cq,
+                                struct blkhash_completion *out,
+                                unsigned count, bool *have_more)
+{
+    uint64_t pos = cq->head;
+    unsigned n = 0;
+
+    for (;;) {
+        struct completion_slot *slot = &cq->slots[pos & cq->mask];
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST);
+
+        if (seq != pos + 1) {
+            /* Not published yet. */
+            if (cq->head == pos)
+                break;
+
+            /* Publish our position and check again, so a worker publishing
+             * this slot now will see that the queue is empty. Updating the
+             * head only here keeps the workers from reading a modified cache
+             * line for every completion. */
+            __atomic_store_n(&cq->head, pos, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        if (n == count) {
+            *have_more = true;
+            break;
+        }
+
+        out[n++] = slot->completion;
+
+        /* Release the slot to the workers in the next round. */
+        __atomic_store_n(&slot->seq, pos + cq->mask + 1, __ATOMIC_RELEASE);
+        pos++;
+    }
+
+    if (cq->head != pos)
+        __atomic_store_n(&cq->head, pos, __ATOMIC_SEQ_CST);
+
+    return n;
+}
+
+/* Return the number of async updates not completed yet. */
+static inline unsigned inflight_updates(struct blkhash *h)
+{
+    return __atomic_load_n(&h->inflight, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Busy poll until some completions are ready or the busy poll period
+ * expires. If no completion is ready, arm the event so the next completion
+ * signals it.
+ */
+static unsigned busy_poll_completions(struct blkhash *h,
+                                      struct blkhash_completion *out,
+                                      unsigned count, bool *have_more)
+{
+    struct completion_queue *cq = &h->cq;
+    unsigned n;
+
+    /* If no update is inflight, no completion can arrive. */
+    if (inflight_updates(h) > 0) {
+        uint64_t deadline = now_usec() + cq->busy_poll;
+
+        do {
+            for (unsigned i = 0; i < BUSY_POLL_RELAX; i++)
+                cpu_relax();
+
+            n = pop_completions(cq, out, count, have_more);
+            if (n > 0)
+                return n;
+        } while (now_usec() < deadline);
+    }
+
+    /* Pairs with update_completed(), ensuring that either we see the
+     * completion, or the worker sees that the event is armed. */
+    __atomic_store_n(&cq->armed, true, __ATOMIC_SEQ_CST);
+
+    n = pop_completions(cq, out, count, have_more);
+    if (n > 0) {
+        /* A worker may signal the event before seeing this, causing a
+         * spurious wakeup. */
+        __atomic_store_n(&cq->armed, false, __ATOMIC_RELAXED);
+    }
+
+    return n;
+}
+
+static void destroy_completion_queue(struct completion_queue *cq)
+{
+    free(cq->slots);
+}
+
 struct blkhash *blkhash_new()
 {
     return blkhash_new_opts(&default_opts);
@@ -183,24 +687,76 @@ struct blkhash *blkhash_new_opts(const struct blkhash_opts *opts)
     if (err)
         goto error;
 
-    err = hash_pool_init(&h->pool, &h->config);
+    h->block_callback = opts->block_callback;
+    h->block_callback_data = opts->block_callback_data;
+    h->completion_callback = opts->completion_callback;
+    h->completion_callback_data = opts->completion_callback_data;
+    h->resumable = opts->resumable;
+
+    if (opts->partial) {
+        /* Keep room for the header, written when the hash is finalized. */
+        h->partial_stream.capacity = sizeof(struct partial_header) + KiB;
+        h->partial_stream.data = malloc(h->partial_stream.capacity);
+        if (h->partial_stream.data == NULL) {
+            err = errno;
+            goto error;
+        }
+
+        h->partial_stream.len = sizeof(struct partial_header);
+        h->partial = true;
+    }
+
+    if (opts->pool) {
+        h->pool = &opts->pool->pool;
+    } else {
+        /* Every worker queue can hold all submissions, so submitting never
+         * waits for the workers. */
+        err = hash_pool_init(&h->own_pool, h->config.workers,
+                             h->config.max_submissions, &h->config.cpus);
+        if (err)
+            goto error;
+
+        if (h->config.min_workers < h->config.workers)
+            hash_pool_enable_autoscale(&h->own_pool, h->config.min_workers);
+
+        h->pool = &h->own_pool;
+    }
+
+    err = submission_arena_init(&h->arena, &h->config);
     if (err)
         goto error;
 
+    /* Workers hash the copy buffers, so allocate them on the workers node
+     * instead of the node of the caller thread. */
+    if (h->pool == &h->own_pool && !cpu_mask_empty(&h->config.cpus)) {
+        err = submission_arena_place_buffers(&h->arena, &h->config.cpus);
+        if (err)
+            goto error;
+    }
+
     err = submission_queue_init(&h->sq, h->config.max_submissions);
     if (err)
         goto error;
 
+    h->batch = calloc(h->config.max_submissions, sizeof(*h->batch));
+    if (h->batch == NULL) {
+        err = errno;
+        goto error;
+    }
+
     if (h->config.queue_depth > 0) {
-        err = pthread_mutex_init(&h->cq.mutex, NULL);
+        err = completion_pool_init(&h->completions, h->config.queue_depth);
         if (err)
             goto error;
+    }
 
-        h->cq.array = calloc(h->config.queue_depth, sizeof(*h->cq.array));
-        if (h->cq.array == NULL) {
-            err = errno;
+    /* The completion queue is not needed when using a completion
+     * callback. */
+    if (h->config.queue_depth > 0 && h->completion_callback == NULL) {
+        err = init_completion_queue(&h->cq, h->config.queue_depth,
+                                    opts->busy_poll);
+        if (err)
             goto error;
-        }
 
         err = event_open(&h->cq.event, EVENT_CLOEXEC | EVENT_NONBLOCK);
         if (err) {
@@ -215,13 +771,24 @@ struct blkhash *blkhash_new_opts(const struct blkhash_opts *opts)
         goto error;
     }
 
-    err = -digest_create(h->config.digest_name, &h->outer_digest);
-    if (err)
-        goto error;
+    for (unsigned i = 0; i < h->config.digests_count; i++) {
+        err = init_outer_buffers(&h->outer_buffers[i], &h->config.digests[i]);
+        if (err)
+            goto error;
 
-    err = -digest_init(h->outer_digest);
-    if (err)
-        goto error;
+        if (h->resumable)
+            err = -digest_create_resumable(h->config.digests[i].name,
+                                           &h->outer_digests[i]);
+        else
+            err = -digest_create(h->config.digests[i].name,
+                                 &h->outer_digests[i]);
+        if (err)
+            goto error;
+
+        err = -digest_init(h->outer_digests[i]);
+        if (err)
+            goto error;
+    }
 
     return h;
 
@@ -232,31 +799,277 @@ error:
     return NULL;
 }
 
-static int hash_submission(struct blkhash *h, const struct submission *sub)
+/* Add the staged block digests to the outer digest. */
+static int flush_staged(struct blkhash *h, unsigned i)
 {
+    struct outer_buffers *b = &h->outer_buffers[i];
     int err;
 
-    err = submission_error(sub);
+    if (b->staged_len == 0)
+        return 0;
+
+    err = -digest_update(h->outer_digests[i], b->staged, b->staged_len);
+    b->staged_len = 0;
     if (err)
         return set_error(h, err);
 
-    /* Add zero blocks before this block. */
-    while (h->hashed_index < sub->index) {
-        //fprintf(stderr, "hash zero block %ld\n", h->hashed_index);
-        err = -digest_update(h->outer_digest, h->config.zero_md,
-                             h->config.md_len);
-        if (err)
-            return set_error(h, err);
+    return 0;
+}
 
-        h->hashed_index++;
+/* Report the zero blocks not reported yet as one run. */
+static int report_zero_run(struct blkhash *h)
+{
+    struct blkhash_block block = {
+        .index = h->zero_run_index,
+        .count = h->zero_run_count,
+        .len = h->config.block_size,
+        .zero = true,
+    };
+    int err;
+
+    if (h->zero_run_count == 0)
+        return 0;
+
+    for (unsigned i = 0; i < h->config.digests_count; i++) {
+        block.md[i] = h->config.digests[i].zero_md;
+        block.md_len[i] = h->config.digests[i].md_len;
+    }
+
+    h->zero_run_count = 0;
+
+    err = h->block_callback(&block, h->block_callback_data);
+    if (err)
+        return set_error(h, err);
+
+    return 0;
+}
+
+static int report_data_block(struct blkhash *h, int64_t index,
+                             unsigned char (*md)[BLKHASH_MAX_MD_SIZE])
+{
+    /* The message length includes this block, and only the last block may
+     * be partial. */
+    uint64_t offset = index * h->config.block_size;
+    struct blkhash_block block = {
+        .index = index,
+        .count = 1,
+        .len = MIN(h->message_length - offset, h->config.block_size),
+        .zero = false,
+    };
+    int err;
+
+    if (report_zero_run(h))
+        return -1;
+
+    for (unsigned i = 0; i < h->config.digests_count; i++) {
+        block.md[i] = md[i];
+        block.md_len[i] = h->config.digests[i].md_len;
+    }
+
+    err = h->block_callback(&block, h->block_callback_data);
+    if (err)
+        return set_error(h, err);
+
+    return 0;
+}
+
+/* Make room for len more bytes in the partial stream. */
+static int reserve_partial(struct blkhash *h, size_t len)
+{
+    struct partial_stream *s = &h->partial_stream;
+    size_t capacity = s->capacity;
+    unsigned char *data;
+
+    if (s->len + len <= s->capacity)
+        return 0;
+
+    while (capacity < s->len + len)
+        capacity *= 2;
+
+    data = realloc(s->data, capacity);
+    if (data == NULL)
+        return set_error(h, errno);
+
+    s->data = data;
+    s->capacity = capacity;
+    return 0;
+}
+
+/*
+ * Add count blocks to the partial stream, extending the last entry if it is
+ * the same kind. Return a pointer to the space for the block digests of data
+ * blocks.
+ */
+static unsigned char *add_partial_blocks(struct blkhash *h, uint64_t count,
+                                         bool zero, size_t digests_len)
+{
+    struct partial_stream *s = &h->partial_stream;
+    struct partial_entry entry;
+
+    if (s->last) {
+        memcpy(&entry, s->data + s->last, sizeof(entry));
+
+        /* The last entry is at the end of the stream, so we can add more
+         * block digests after it. */
+        if (entry.zero == zero) {
+            if (reserve_partial(h, digests_len))
+                return NULL;
+
+            entry.count += count;
+            memcpy(s->data + s->last, &entry, sizeof(entry));
+            s->len += digests_len;
+            return s->data + s->len - digests_len;
+        }
+    }
+
+    if (reserve_partial(h, sizeof(entry) + digests_len))
+        return NULL;
+
+    entry = (struct partial_entry){.count = count, .zero = zero};
+    memcpy(s->data + s->len, &entry, sizeof(entry));
+    s->last = s->len;
+    s->len += sizeof(entry) + digests_len;
+    return s->data + s->len - digests_len;
+}
+
+/* Return the size of the block digests of one block. */
+static size_t block_digests_len(struct blkhash *h)
+{
+    size_t len = 0;
+
+    for (unsigned i = 0; i < h->config.digests_count; i++)
+        len += h->config.digests[i].md_len;
+
+    return len;
+}
+
+static int add_partial_data_block(struct blkhash *h,
+                                  unsigned char (*md)[BLKHASH_MAX_MD_SIZE])
+{
+    unsigned char *p;
+
+    p = add_partial_blocks(h, 1, false, block_digests_len(h));
+    if (p == NULL)
+        return -1;
+
+    for (unsigned i = 0; i < h->config.digests_count; i++) {
+        memcpy(p, md[i], h->config.digests[i].md_len);
+        p += h->config.digests[i].md_len;
+    }
+
+    return 0;
+}
+
+/* Stage the block digests, flushing the staged digests when full. */
+static int add_data_block(struct blkhash *h,
+                          unsigned char (*md)[BLKHASH_MAX_MD_SIZE])
+{
+    if (h->block_callback) {
+        if (report_data_block(h, h->hashed_index, md))
+            return -1;
+    }
+
+    if (h->partial)
+        return add_partial_data_block(h, md);
+
+    for (unsigned i = 0; i < h->config.digests_count; i++) {
+        struct outer_buffers *b = &h->outer_buffers[i];
+        unsigned md_len = h->config.digests[i].md_len;
+
+        if (b->staged_len + md_len > OUTER_BUFFER_SIZE) {
+            if (flush_staged(h, i))
+                return -1;
+        }
+
+        memcpy(b->staged + b->staged_len, md[i], md_len);
+        b->staged_len += md_len;
+    }
+
+    return 0;
+}
+
+/*
+ * Add count zero block digests to the outer digests. Short runs are staged,
+ * and long runs are added directly from the zeros buffer, avoiding a
+ * digest_update() call per block.
+ */
+static int add_zero_blocks(struct blkhash *h, uint64_t count)
+{
+    int err;
+
+    /* Consecutive zero blocks are reported later as one run. */
+    if (h->block_callback) {
+        if (h->zero_run_count == 0)
+            h->zero_run_index = h->hashed_index;
+        h->zero_run_count += count;
+    }
+
+    if (h->partial)
+        return add_partial_blocks(h, count, true, 0) ? 0 : -1;
+
+    for (unsigned i = 0; i < h->config.digests_count; i++) {
+        struct outer_buffers *b = &h->outer_buffers[i];
+        unsigned md_len = h->config.digests[i].md_len;
+        unsigned zeros_count;
+        uint64_t n = count;
+
+        if (md_len == 0)
+            continue;
+
+        zeros_count = b->zeros_len / md_len;
+
+        while (n > 0) {
+            unsigned space;
+
+            if (b->staged_len == 0 && n >= zeros_count) {
+                err = -digest_update(h->outer_digests[i], b->zeros,
+                                     b->zeros_len);
+                if (err)
+                    return set_error(h, err);
+
+                n -= zeros_count;
+                continue;
+            }
+
+            space = (OUTER_BUFFER_SIZE - b->staged_len) / md_len;
+            if (space == 0) {
+                if (flush_staged(h, i))
+                    return -1;
+                continue;
+            }
+
+            /* The zeros buffer holds more digests than the free space. */
+            space = MIN(space, n);
+            memcpy(b->staged + b->staged_len, b->zeros, space * md_len);
+            b->staged_len += space * md_len;
+            n -= space;
+        }
+    }
+
+    return 0;
+}
+
+static int hash_submission(struct blkhash *h, struct submission *sub)
+{
+    int err;
+
+    err = submission_error(sub);
+    if (err)
+        return set_error(h, err);
+
+    /* Add zero blocks before this block. */
+    if (h->hashed_index < sub->index) {
+        if (add_zero_blocks(h, sub->index - h->hashed_index))
+            return -1;
+
+        h->hashed_index = sub->index;
     }
 
     /* Hash this block. */
     if (!submission_is_zero(sub)) {
         //fprintf(stderr, "hash data block %ld\n", sub->index);
-        err = -digest_update(h->outer_digest, sub->md, h->config.md_len);
-        if (err)
-            return set_error(h, err);
+        if (add_data_block(h, sub->md))
+            return -1;
 
         h->hashed_index++;
     }
@@ -277,10 +1090,38 @@ static int hash_message_length(struct blkhash *h)
     int err;
 
     //printf("message-length: %lu\n", h->message_length);
-    err = -digest_update(h->outer_digest, &data, sizeof(data));
+    for (unsigned i = 0; i < h->config.digests_count; i++) {
+        if (flush_staged(h, i))
+            return -1;
+
+        err = -digest_update(h->outer_digests[i], &data, sizeof(data));
+        if (err)
+            return set_error(h, err);
+    }
+
+    return 0;
+}
+
+/* Send the batched submissions to the hash pool. */
+static int submit_batch(struct blkhash *h)
+{
+    int err;
+
+    if (h->batch_len == 0)
+        return 0;
+
+    /* On errors the submissions are completed with the error, and we will
+     * fail when hashing them. */
+    err = hash_pool_submit_batch(h->pool, h->batch, h->batch_len);
+    h->batch_len = 0;
     if (err)
         return set_error(h, err);
 
+    if (h->pool == &h->own_pool) {
+        struct wait_stats *stats = &h->arena.stats;
+        hash_pool_autoscale(h->pool, stats->spin_usec + stats->sleep_usec);
+    }
+
     return 0;
 }
 
@@ -294,6 +1135,10 @@ static int maybe_hash_first_submission(struct blkhash *h)
     if (!submission_queue_full(&h->sq))
         return 0;
 
+    /* The first submission may be in the batch. */
+    if (submit_batch(h))
+        return h->error;
+
     err = submission_queue_pop(&h->sq, &sub);
     if (err)
         return set_error(h, err);
@@ -334,6 +1179,9 @@ static int hash_inflight_submissions(struct blkhash *h)
 {
     struct submission *sub = NULL;
 
+    if (submit_batch(h))
+        return h->error;
+
     while ((sub = submission_queue_first(&h->sq))) {
         submission_wait(sub);
 
@@ -349,6 +1197,27 @@ static int hash_inflight_submissions(struct blkhash *h)
     return 0;
 }
 
+/*
+ * Wait until the workers are done with our submissions, without adding them
+ * to the outer hash.
+ */
+static void wait_for_submissions(struct blkhash *h)
+{
+    struct submission *sub;
+
+    submit_batch(h);
+
+    while ((sub = submission_queue_first(&h->sq))) {
+        submission_wait(sub);
+        submission_queue_pop(&h->sq, NULL);
+        submission_destroy(sub);
+    }
+
+    /* Workers may still access the arena after completing the last
+     * submission. */
+    submission_arena_quiesce(&h->arena);
+}
+
 /*
  * Submit one zero length block, adding zero blocks since the last hashed
  * index.
@@ -361,7 +1230,7 @@ static int submit_zero_block(struct blkhash *h)
     if (maybe_hash_first_submission(h))
         return h->error;
 
-    err = submission_create_zero(h->block_index, &sub);
+    err = submission_create_zero(&h->arena, h->block_index, &sub);
     if (err)
         return set_error(h, err);
 
@@ -373,14 +1242,12 @@ static int submit_zero_block(struct blkhash *h)
 
     h->submitted_index = h->block_index;
 
-    if (hash_completed_submissions(h))
-        return h->error;
-
     return 0;
 }
 
 /*
- * Submit one data block to the hash pool.
+ * Add one data block to the batch. The batch is submitted to the hash pool
+ * by submit_batch().
  */
 static int submit_data_block(struct blkhash *h, const void *buf, size_t len,
                              struct completion *completion, uint8_t flags)
@@ -391,8 +1258,8 @@ static int submit_data_block(struct blkhash *h, const void *buf, size_t len,
     if (maybe_hash_first_submission(h))
         return h->error;
 
-    err = submission_create_data(h->block_index, len, buf, completion, flags,
-                                 &sub);
+    err = submission_create_data(&h->arena, h->block_index, len, buf,
+                                 completion, flags, &sub);
     if (err)
         return set_error(h, err);
 
@@ -402,16 +1269,11 @@ static int submit_data_block(struct blkhash *h, const void *buf, size_t len,
         return set_error(h, err);
     }
 
-    err = hash_pool_submit(&h->pool, sub);
-    if (err)
-        return set_error(h, err);
+    h->batch[h->batch_len++] = sub;
 
     h->submitted_index = h->block_index;
     h->block_index++;
 
-    if (hash_completed_submissions(h))
-        return h->error;
-
     return 0;
 }
 
@@ -481,9 +1343,39 @@ static inline int consume_zero_blocks(struct blkhash *h, size_t count)
     return 0;
 }
 
-static inline bool is_zero_block(struct blkhash *h, const void *buf, size_t len)
+/*
+ * Copy a full block of data to a new submission and add it to the batch. If
+ * the block is zero, consume it as zero block.
+ */
+static int submit_copied_block(struct blkhash *h, const void *buf, size_t len,
+                               struct completion *completion)
 {
-    return len == h->config.block_size && is_zero(buf, len);
+    struct submission *sub = NULL;
+    int err;
+
+    if (maybe_hash_first_submission(h))
+        return h->error;
+
+    err = submission_create_copy(&h->arena, h->block_index, len, buf,
+                                 completion, &sub);
+    if (err)
+        return set_error(h, err);
+
+    if (sub == NULL)
+        return consume_zero_blocks(h, 1);
+
+    err = submission_queue_push(&h->sq, sub);
+    if (err) {
+        submission_destroy(sub);
+        return set_error(h, err);
+    }
+
+    h->batch[h->batch_len++] = sub;
+
+    h->submitted_index = h->block_index;
+    h->block_index++;
+
+    return 0;
 }
 
 /*
@@ -494,15 +1386,12 @@ static inline bool is_zero_block(struct blkhash *h, const void *buf, size_t len)
 static int consume_data_block(struct blkhash *h, const void *buf, size_t len,
                               struct completion *completion, uint8_t flags)
 {
-    /* If we copy data, it worth to eliminate zero blocks now. Otherwise it is
-     * better to do this work in the worker. */
-    if ((flags & SUBMIT_COPY_DATA) && is_zero_block(h, buf, len)) {
-        /* Fast path. */
-        return consume_zero_blocks(h, 1);
-    } else {
-        /* Slow path. */
+    /* If we copy data, it worth to eliminate zero blocks now, detecting zeros
+     * while copying. Otherwise it is better to do this work in the worker. */
+    if ((flags & SUBMIT_COPY_DATA) && len == h->config.block_size)
+        return submit_copied_block(h, buf, len, completion);
+    else
         return submit_data_block(h, buf, len, completion, flags);
-    }
 }
 
 /*
@@ -542,6 +1431,21 @@ static int consume_pending(struct blkhash *h, struct completion *completion)
     return 0;
 }
 
+/*
+ * Submit the blocks collected while consuming an update and add completed
+ * submissions to the outer hash.
+ */
+static int end_update(struct blkhash *h)
+{
+    if (submit_batch(h))
+        return h->error;
+
+    if (hash_completed_submissions(h))
+        return h->error;
+
+    return 0;
+}
+
 static int do_update(struct blkhash *h, const void *buf, size_t len,
                      struct completion *completion, uint8_t flags)
 {
@@ -552,7 +1456,7 @@ static int do_update(struct blkhash *h, const void *buf, size_t len,
         len -= n;
         if (h->pending.len == h->config.block_size) {
             if (consume_pending(h, completion))
-                return h->error;
+                goto fail;
         }
     }
 
@@ -560,7 +1464,7 @@ static int do_update(struct blkhash *h, const void *buf, size_t len,
     while (len >= h->config.block_size) {
         if (consume_data_block(h, buf, h->config.block_size, completion,
                                flags))
-            return h->error;
+            goto fail;
 
         buf += h->config.block_size;
         len -= h->config.block_size;
@@ -570,7 +1474,24 @@ static int do_update(struct blkhash *h, const void *buf, size_t len,
     if (len > 0)
         add_pending_data(h, buf, len);
 
-    return 0;
+    return end_update(h);
+
+fail:
+    /* Batched submissions hold a reference to the completion, so they must
+     * complete even if we failed. */
+    submit_batch(h);
+    return h->error;
+}
+
+/*
+ * Return true if the last range added by blkhash_add_partial() ended with a
+ * partial block. The next data would start in the middle of a block, so the
+ * hash can only be finalized.
+ */
+static inline bool ended_with_partial_block(struct blkhash *h)
+{
+    return h->pending.len == 0 &&
+        h->message_length % h->config.block_size != 0;
 }
 
 int blkhash_update(struct blkhash *h, const void *buf, size_t len)
@@ -578,28 +1499,38 @@ int blkhash_update(struct blkhash *h, const void *buf, size_t len)
     if (h->error)
         return h->error;
 
+    if (ended_with_partial_block(h))
+        return EINVAL;
+
     h->message_length += len;
 
+    if (h->config.zero_copy) {
+        /* The workers use the caller buffer directly, so we must wait until
+         * all submissions are completed before returning, also on errors. */
+        if (do_update(h, buf, len, NULL, 0) == 0 &&
+                hash_inflight_submissions(h) == 0)
+            return 0;
+
+        wait_for_submissions(h);
+        return h->error;
+    }
+
     /* We copy user data to simplify the interface. Users that want higher
-     * performance should use the async interface. */
+     * performance should use the async interface or the zero copy option. */
     return do_update(h, buf, len, NULL, SUBMIT_COPY_DATA);
 }
 
 static void update_completed(struct blkhash *h, void *user_data, int error)
 {
-    struct blkhash_completion *c;
-    int err;
     bool was_empty;
+    int err;
 
-    mutex_lock(&h->cq.mutex);
-
-    was_empty = h->cq.count == 0;
-    assert(h->cq.count < h->config.queue_depth);
-    c = &h->cq.array[h->cq.count++];
-    c->user_data = user_data;
-    c->error = error;
+    was_empty = push_completion(&h->cq, user_data, error);
 
-    mutex_unlock(&h->cq.mutex);
+    /* In busy poll mode the caller checks the queue without waiting on the
+     * event, and arms the event only when the queue was empty for a while. */
+    if (h->cq.busy_poll)
+        was_empty = __atomic_exchange_n(&h->cq.armed, false, __ATOMIC_SEQ_CST);
 
     if (was_empty) {
         /* If we cannot noitify, the caller may get stuck waiting for
@@ -610,26 +1541,49 @@ static void update_completed(struct blkhash *h, void *user_data, int error)
     }
 }
 
+/* Deliver the completion directly on the thread completing the update. */
+static void update_completed_callback(struct blkhash *h, void *user_data,
+                                      int error)
+{
+    struct blkhash_completion c = {.user_data = user_data, .error = error};
+    blkhash_completion_callback callback = h->completion_callback;
+    void *callback_data = h->completion_callback_data;
+
+    /* The caller may start another update or reset the hash once the
+     * callback was called, so we must not access the hash after it. */
+    __atomic_sub_fetch(&h->inflight, 1, __ATOMIC_RELEASE);
+
+    callback(&c, callback_data);
+}
+
 int blkhash_aio_update(struct blkhash *h, const void *buf, size_t len,
                        void *user_data)
 {
     struct completion *completion;
+    completion_callback cb;
+    int err;
 
     if (h->error)
         return h->error;
 
-    /* Accessed only by caller thread, no locking needed. */
-    if (h->inflight >= h->config.queue_depth)
+    if (ended_with_partial_block(h))
+        return EINVAL;
+
+    /* Increased only by the caller thread, but workers may decrease it when
+     * using a completion callback. */
+    if (inflight_updates(h) >= h->config.queue_depth)
         return EAGAIN;
 
-    h->inflight++;
+    cb = h->completion_callback ? update_completed_callback : update_completed;
 
-    completion = completion_new(update_completed, h, user_data);
-    if (completion == NULL) {
-        set_error(h, errno);
+    err = completion_new(&h->completions, cb, h, user_data, &completion);
+    if (err) {
+        set_error(h, err);
         return h->error;
     }
 
+    __atomic_add_fetch(&h->inflight, 1, __ATOMIC_RELAXED);
+
     h->message_length += len;
 
     /* We don't copy user data, and the user must wait for completion before
@@ -655,36 +1609,28 @@ int blkhash_aio_completions(struct blkhash *h, struct blkhash_completion *out,
                             unsigned count)
 {
     bool have_more = false;
+    unsigned n;
+
+    if (h->cq.event == NULL)
+        return -ENOTSUP;
 
     if (h->error)
         return -h->error;
 
-    mutex_lock(&h->cq.mutex);
-
-    count = MIN(count, h->cq.count);
-    if (count > 0) {
-        size_t bytes = count * sizeof(*h->cq.array);
-        memcpy(out, h->cq.array, bytes);
-        h->cq.count -= count;
+    /* There is no reason to call with count < queue_depth, so have_more
+     * should not be set. */
+    n = pop_completions(&h->cq, out, count, &have_more);
+    if (n == 0 && h->cq.busy_poll)
+        n = busy_poll_completions(h, out, count, &have_more);
 
-        if (h->cq.count > 0) {
-            /* There is no reason to call with count < queue_depth, so this
-             * should not happen. */
-            size_t bytes = h->cq.count * sizeof(*h->cq.array);
-            memmove(&h->cq.array[0], &h->cq.array[count], bytes);
-            have_more = true;
-        }
+    if (n > 0) {
+        assert(inflight_updates(h) >= n);
+        __atomic_sub_fetch(&h->inflight, n, __ATOMIC_RELAXED);
     }
 
-    mutex_unlock(&h->cq.mutex);
-
-    /* Accessed only by caller thread, no locking needed. */
-    if (count > 0) {
-        assert(h->inflight >= count);
-        h->inflight -= count;
-    }
-
-    if (have_more) {
+    /* In busy poll mode the caller must call again until there are no more
+     * completions, so there is no need to signal. */
+    if (have_more && !h->cq.busy_poll) {
         /* If not all completions consumed (unlikely), signal the completion fd
          * so the user will get a notification on the next poll. */
         int err = event_signal(h->cq.event);
@@ -694,7 +1640,7 @@ int blkhash_aio_completions(struct blkhash *h, struct blkhash_completion *out,
         }
     }
 
-    return count;
+    return n;
 }
 
 int blkhash_zero(struct blkhash *h, size_t len)
@@ -702,6 +1648,9 @@ int blkhash_zero(struct blkhash *h, size_t len)
     if (h->error)
         return h->error;
 
+    if (ended_with_partial_block(h))
+        return EINVAL;
+
     h->message_length += len;
 
     /* Try to fill the pending buffer and consume it. */
@@ -725,15 +1674,75 @@ int blkhash_zero(struct blkhash *h, size_t len)
     if (len > 0)
         add_pending_zeros(h, len);
 
+    if (end_update(h))
+        return h->error;
+
     return 0;
 }
 
-int blkhash_final(struct blkhash *h, unsigned char *md_value,
-                  unsigned int *md_len)
+/* Queue a data block using the block digests computed before. */
+static int submit_digest_block(struct blkhash *h, const unsigned char *const *md)
 {
-    if (h->finalized)
+    struct submission *sub = NULL;
+    int err;
+
+    if (maybe_hash_first_submission(h))
+        return h->error;
+
+    err = submission_create_digest(&h->arena, h->block_index, md, &sub);
+    if (err)
+        return set_error(h, err);
+
+    err = submission_queue_push(&h->sq, sub);
+    if (err) {
+        submission_destroy(sub);
+        return set_error(h, err);
+    }
+
+    h->submitted_index = h->block_index;
+    h->block_index++;
+
+    return 0;
+}
+
+int blkhash_add_block(struct blkhash *h, const struct blkhash_block *block)
+{
+    if (h->error)
+        return h->error;
+
+    /* The block digests must be for the next full block. Adding a partial
+     * block would leave the hash at a length we cannot complete. */
+    if (h->finalized || h->pending.len > 0 || ended_with_partial_block(h) ||
+            block->index != (uint64_t)h->block_index || block->count == 0 ||
+            block->len != h->config.block_size)
         return EINVAL;
 
+    if (block->zero)
+        return blkhash_zero(h, block->count * h->config.block_size);
+
+    if (block->count != 1)
+        return EINVAL;
+
+    for (unsigned i = 0; i < h->config.digests_count; i++) {
+        if (block->md[i] == NULL ||
+                block->md_len[i] != h->config.digests[i].md_len)
+            return EINVAL;
+    }
+
+    h->message_length += h->config.block_size;
+
+    if (submit_digest_block(h, block->md))
+        return h->error;
+
+    if (end_update(h))
+        return h->error;
+
+    return 0;
+}
+
+/* Consume the last block and wait until all blocks are hashed. */
+static int finish_blocks(struct blkhash *h)
+{
     h->finalized = true;
 
     if (h->pending.len > 0) {
@@ -747,10 +1756,435 @@ int blkhash_final(struct blkhash *h, unsigned char *md_value,
     if (hash_inflight_submissions(h))
         return h->error;
 
+    if (h->block_callback) {
+        if (report_zero_run(h))
+            return h->error;
+    }
+
+    return 0;
+}
+
+int blkhash_final(struct blkhash *h, unsigned char *md_value,
+                  unsigned int *md_len)
+{
+    /* The outer digests are not computed in partial mode. */
+    if (h->finalized || h->partial)
+        return EINVAL;
+
+    if (finish_blocks(h))
+        return h->error;
+
     if (hash_message_length(h))
         return h->error;
 
-    return -digest_final(h->outer_digest, md_value, md_len);
+    for (unsigned i = 0; i < h->config.digests_count; i++) {
+        int err = -digest_final(h->outer_digests[i], h->md_values[i],
+                                &h->md_lens[i]);
+        if (err)
+            return err;
+    }
+
+    h->have_md_values = true;
+
+    return blkhash_get_digest(h, 0, md_value, md_len);
+}
+
+int blkhash_get_digest(struct blkhash *h, unsigned index,
+                       unsigned char *md_value, unsigned int *md_len)
+{
+    if (!h->have_md_values || index >= h->config.digests_count)
+        return EINVAL;
+
+    memcpy(md_value, h->md_values[index], h->md_lens[index]);
+
+    if (md_len)
+        *md_len = h->md_lens[index];
+
+    return 0;
+}
+
+int blkhash_final_partial(struct blkhash *h, const void **buf, size_t *len)
+{
+    struct partial_header header = {0};
+
+    if (h->finalized || !h->partial)
+        return EINVAL;
+
+    if (finish_blocks(h))
+        return h->error;
+
+    memcpy(header.magic, PARTIAL_MAGIC, sizeof(header.magic));
+    header.block_size = h->config.block_size;
+    header.digests_count = h->config.digests_count;
+    header.message_length = h->message_length;
+
+    for (unsigned i = 0; i < h->config.digests_count; i++)
+        strncpy(header.digest_names[i], h->config.digests[i].name,
+                STATE_NAME_SIZE);
+
+    memcpy(h->partial_stream.data, &header, sizeof(header));
+
+    *buf = h->partial_stream.data;
+    *len = h->partial_stream.len;
+    return 0;
+}
+
+/*
+ * Return true if the partial state matches the hash configuration and the
+ * entries match the message length.
+ */
+static bool valid_partial(struct blkhash *h, const struct partial_header *header,
+                          const void *buf, size_t len)
+{
+    size_t digests_len = block_digests_len(h);
+    size_t offset = sizeof(*header);
+    uint64_t blocks = 0;
+
+    if (memcmp(header->magic, PARTIAL_MAGIC, sizeof(header->magic)) != 0 ||
+            header->block_size != h->config.block_size ||
+            header->digests_count != h->config.digests_count)
+        return false;
+
+    for (unsigned i = 0; i < h->config.digests_count; i++) {
+        if (strncmp(header->digest_names[i], h->config.digests[i].name,
+                    STATE_NAME_SIZE) != 0)
+            return false;
+    }
+
+    while (offset < len) {
+        struct partial_entry entry;
+
+        if (len - offset < sizeof(entry))
+            return false;
+
+        memcpy(&entry, buf + offset, sizeof(entry));
+        offset += sizeof(entry);
+
+        if (!entry.zero) {
+            if (entry.count > (len - offset) / MAX(digests_len, 1))
+                return false;
+            offset += entry.count * digests_len;
+        }
+
+        blocks += entry.count;
+    }
+
+    return blocks == (header->message_length + h->config.block_size - 1) /
+                     h->config.block_size;
+}
+
+int blkhash_add_partial(struct blkhash *h, const void *buf, size_t len)
+{
+    unsigned char md[BLKHASH_MAX_DIGESTS][BLKHASH_MAX_MD_SIZE];
+    struct partial_header header;
+    size_t offset = sizeof(header);
+
+    if (h->error)
+        return h->error;
+
+    if (inflight_updates(h) > 0)
+        return EBUSY;
+
+    /* The partial state must start at a block boundary. */
+    if (h->finalized || h->pending.len > 0 ||
+            h->message_length % h->config.block_size != 0)
+        return EINVAL;
+
+    if (len < sizeof(header))
+        return EINVAL;
+
+    /* The buffer may not be aligned. */
+    memcpy(&header, buf, sizeof(header));
+
+    if (!valid_partial(h, &header, buf, len))
+        return EINVAL;
+
+    /* Add the previous blocks before the blocks of the partial state. */
+    if (hash_inflight_submissions(h))
+        return h->error;
+
+    /* The block callback reports the block length using the message
+     * length. */
+    h->message_length += header.message_length;
+
+    if (h->hashed_index < h->block_index) {
+        if (add_zero_blocks(h, h->block_index - h->hashed_index))
+            return h->error;
+
+        h->hashed_index = h->block_index;
+    }
+
+    while (offset < len) {
+        struct partial_entry entry;
+
+        memcpy(&entry, buf + offset, sizeof(entry));
+        offset += sizeof(entry);
+
+        if (entry.zero) {
+            if (add_zero_blocks(h, entry.count))
+                return h->error;
+
+            h->hashed_index += entry.count;
+            continue;
+        }
+
+        for (uint64_t n = 0; n < entry.count; n++) {
+            for (unsigned i = 0; i < h->config.digests_count; i++) {
+                memcpy(md[i], buf + offset, h->config.digests[i].md_len);
+                offset += h->config.digests[i].md_len;
+            }
+
+            if (add_data_block(h, md))
+                return h->error;
+
+            h->hashed_index++;
+        }
+    }
+
+    h->block_index = h->hashed_index;
+    h->submitted_index = h->hashed_index;
+
+    return 0;
+}
+
+int blkhash_reset(struct blkhash *h)
+{
+    int err;
+
+    /* The caller must reap all async updates, unless the hash failed, and
+     * the completions cannot be reaped. */
+    if (inflight_updates(h) > 0 && h->error == 0)
+        return EBUSY;
+
+    /* Submissions are completed after their async update completion, so
+     * once all submissions are completed and the arena is quiesced no
+     * worker can access the hash. */
+    wait_for_submissions(h);
+
+    if (h->cq.event) {
+        struct blkhash_completion sink[16];
+        bool have_more;
+
+        do {
+            have_more = false;
+            pop_completions(&h->cq, sink, ARRAY_SIZE(sink), &have_more);
+        } while (have_more);
+
+        while (event_wait(h->cq.event) > 0)
+            ;
+
+        h->cq.armed = true;
+    }
+
+    h->inflight = 0;
+    h->pending.len = 0;
+    h->pending.zero = false;
+    h->block_index = 0;
+    h->submitted_index = 0;
+    h->hashed_index = 0;
+    h->zero_run_count = 0;
+    h->message_length = 0;
+    h->partial_stream.len = sizeof(struct partial_header);
+    h->partial_stream.last = 0;
+    h->finalized = false;
+    h->have_md_values = false;
+    h->error = 0;
+
+    /* If we cannot reinitialize the outer digests, the hash is unusable. */
+    for (unsigned i = 0; i < h->config.digests_count; i++) {
+        h->outer_buffers[i].staged_len = 0;
+
+        err = -digest_init(h->outer_digests[i]);
+        if (err) {
+            set_error(h, err);
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+/* The maximum size of the state, including a full pending block. */
+static size_t max_state_size(struct blkhash *h)
+{
+    size_t size = sizeof(struct saved_state) + h->config.block_size;
+
+    for (unsigned i = 0; i < h->config.digests_count; i++)
+        size += digest_state_size(h->outer_digests[i]);
+
+    return size;
+}
+
+int blkhash_save_state(struct blkhash *h, void *buf, size_t *len)
+{
+    struct saved_state state = {0};
+    size_t max_size;
+    void *p;
+
+    if (h->error)
+        return h->error;
+
+    if (h->finalized)
+        return EINVAL;
+
+    /* The state does not include the partial stream. */
+    if (h->partial)
+        return ENOTSUP;
+
+    if (!h->resumable)
+        return ENOTSUP;
+
+    for (unsigned i = 0; i < h->config.digests_count; i++) {
+        if (!digest_is_resumable(h->outer_digests[i]))
+            return ENOTSUP;
+    }
+
+    max_size = max_state_size(h);
+    if (buf == NULL || *len < max_size) {
+        *len = max_size;
+        return buf == NULL ? 0 : ERANGE;
+    }
+
+    if (inflight_updates(h) > 0)
+        return EBUSY;
+
+    /* Add all submitted blocks to the outer digests, so the outer digests
+     * states include all blocks before hashed_index. */
+    if (hash_inflight_submissions(h))
+        return h->error;
+
+    for (unsigned i = 0; i < h->config.digests_count; i++) {
+        if (flush_staged(h, i))
+            return h->error;
+    }
+
+    memcpy(state.magic, STATE_MAGIC, sizeof(state.magic));
+    state.block_size = h->config.block_size;
+    state.digests_count = h->config.digests_count;
+    state.pending_len = h->pending.len;
+    state.pending_zero = h->pending.zero;
+    state.block_index = h->block_index;
+    state.submitted_index = h->submitted_index;
+    state.hashed_index = h->hashed_index;
+    state.zero_run_index = h->zero_run_index;
+    state.zero_run_count = h->zero_run_count;
+    state.message_length = h->message_length;
+
+    for (unsigned i = 0; i < h->config.digests_count; i++) {
+        strncpy(state.digest_names[i], h->config.digests[i].name,
+                STATE_NAME_SIZE);
+        state.state_sizes[i] = digest_state_size(h->outer_digests[i]);
+    }
+
+    memcpy(buf, &state, sizeof(state));
+    p = buf + sizeof(state);
+
+    if (!h->pending.zero) {
+        memcpy(p, h->pending.data, h->pending.len);
+        p += h->pending.len;
+    }
+
+    for (unsigned i = 0; i < h->config.digests_count; i++) {
+        int err = -digest_save_state(h->outer_digests[i], p);
+        if (err)
+            return set_error(h, err);
+
+        p += state.state_sizes[i];
+    }
+
+    *len = p - buf;
+    return 0;
+}
+
+/* Return true if the saved state matches the hash configuration. */
+static bool valid_state(struct blkhash *h, const struct saved_state *state,
+                        size_t len)
+{
+    size_t size = sizeof(*state);
+
+    if (memcmp(state->magic, STATE_MAGIC, sizeof(state->magic)) != 0 ||
+            state->block_size != h->config.block_size ||
+            state->digests_count != h->config.digests_count ||
+            state->pending_len >= h->config.block_size)
+        return false;
+
+    if (!state->pending_zero)
+        size += state->pending_len;
+
+    for (unsigned i = 0; i < h->config.digests_count; i++) {
+        if (strncmp(state->digest_names[i], h->config.digests[i].name,
+                    STATE_NAME_SIZE) != 0 ||
+                state->state_sizes[i] !=
+                    digest_state_size(h->outer_digests[i]))
+            return false;
+
+        size += state->state_sizes[i];
+    }
+
+    return len == size;
+}
+
+int blkhash_load_state(struct blkhash *h, const void *buf, size_t len)
+{
+    struct saved_state state;
+    const void *p;
+    int err;
+
+    /* The state does not include the partial stream. */
+    if (h->partial)
+        return EINVAL;
+
+    if (!h->resumable)
+        return ENOTSUP;
+
+    for (unsigned i = 0; i < h->config.digests_count; i++) {
+        if (!digest_is_resumable(h->outer_digests[i]))
+            return ENOTSUP;
+    }
+
+    if (len < sizeof(state))
+        return EINVAL;
+
+    /* The buffer may not be aligned. */
+    memcpy(&state, buf, sizeof(state));
+
+    if (!valid_state(h, &state, len))
+        return EINVAL;
+
+    err = blkhash_reset(h);
+    if (err)
+        return err;
+
+    h->pending.len = state.pending_len;
+    h->pending.zero = state.pending_zero;
+    h->block_index = state.block_index;
+    h->submitted_index = state.submitted_index;
+    h->hashed_index = state.hashed_index;
+    h->zero_run_index = state.zero_run_index;
+    h->zero_run_count = state.zero_run_count;
+    h->message_length = state.message_length;
+
+    p = buf + sizeof(state);
+
+    if (!h->pending.zero) {
+        memcpy(h->pending.data, p, h->pending.len);
+        p += h->pending.len;
+    }
+
+    for (unsigned i = 0; i < h->config.digests_count; i++) {
+        err = -digest_load_state(h->outer_digests[i], p);
+        if (err)
+            return set_error(h, err);
+
+        p += state.state_sizes[i];
+    }
+
+    return 0;
+}
+
+void blkhash_get_wait_stats(struct blkhash *h, struct wait_stats *out)
+{
+    *out = h->arena.stats;
 }
 
 void blkhash_free(struct blkhash *h)
@@ -758,17 +2192,29 @@ void blkhash_free(struct blkhash *h)
     if (h == NULL)
         return;
 
-    digest_destroy(h->outer_digest);
+    /* Stop the workers or wait until they are done with our submissions
+     * first; they may still access submissions and complete async updates. */
+    if (h->pool == &h->own_pool)
+        hash_pool_destroy(&h->own_pool);
+    else if (h->pool)
+        wait_for_submissions(h);
+
+    for (unsigned i = 0; i < BLKHASH_MAX_DIGESTS; i++) {
+        digest_destroy(h->outer_digests[i]);
+        free(h->outer_buffers[i].staged);
+    }
     free(h->pending.data);
+    free(h->partial_stream.data);
 
     if (h->config.queue_depth) {
         event_close(h->cq.event);
-        free(h->cq.array);
-        mutex_destroy(&h->cq.mutex);
+        destroy_completion_queue(&h->cq);
+        completion_pool_destroy(&h->completions);
     }
 
+    free(h->batch);
     submission_queue_destroy(&h->sq);
-    hash_pool_destroy(&h->pool);
+    submission_arena_destroy(&h->arena);
 
     free(h);
 }
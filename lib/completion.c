@@ -1,24 +1,82 @@
 // SPDX-FileCopyrightText: Red Hat Inc
 // SPDX-License-Identifier: LGPL-2.1-or-later
 
+#include <errno.h>
+#include <string.h>
+
 #include "blkhash-internal.h"
 
-struct completion *completion_new(completion_callback cb, struct blkhash *hash,
-                                  void *user_data)
+int completion_pool_init(struct completion_pool *p, unsigned size)
+{
+    int err;
+
+    /* Align to avoid false sharing between workers. */
+    err = posix_memalign((void **)&p->array, CACHE_LINE_SIZE,
+                         size * sizeof(*p->array));
+    if (err)
+        return err;
+
+    p->size = size;
+    p->free = NULL;
+    p->released = NULL;
+
+    /* Push in reverse so the first completion is used first. */
+    for (unsigned i = size; i > 0; i--) {
+        struct completion *c = &p->array[i - 1];
+
+        c->pool = p;
+        c->next = p->free;
+        p->free = c;
+    }
+
+    return 0;
+}
+
+void completion_pool_destroy(struct completion_pool *p)
+{
+    free(p->array);
+    memset(p, 0, sizeof(*p));
+}
+
+static void release_completion(struct completion *c)
+{
+    struct completion_pool *p = c->pool;
+    struct completion *head = __atomic_load_n(&p->released, __ATOMIC_RELAXED);
+
+    /* Only the caller removes completions from the released list, and it
+     * takes the entire list, so pushing is not affected by ABA. */
+    do {
+        c->next = head;
+    } while (!__atomic_compare_exchange_n(&p->released, &head, c, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+int completion_new(struct completion_pool *p, completion_callback cb,
+                   struct blkhash *hash, void *user_data,
+                   struct completion **out)
 {
     struct completion *c;
 
-    c = malloc(sizeof(*c));
-    if (c == NULL)
-        return NULL;
+    if (p->free == NULL)
+        p->free = __atomic_exchange_n(&p->released, NULL, __ATOMIC_ACQUIRE);
+
+    /* Cannot happen since live completions are bounded by the queue
+     * depth. */
+    if (p->free == NULL)
+        return ENOBUFS;
+
+    c = p->free;
+    p->free = c->next;
 
     c->callback = cb;
     c->hash = hash;
     c->user_data = user_data;
     c->error = 0;
     c->refs = 1;
+    c->next = NULL;
 
-    return c;
+    *out = c;
+    return 0;
 }
 
 void completion_set_error(struct completion *c, int error)
@@ -37,8 +95,14 @@ void completion_ref(struct completion *c)
 void completion_unref(struct completion *c)
 {
     if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        completion_callback callback = c->callback;
+        struct blkhash *hash = c->hash;
+        void *user_data = c->user_data;
         int error = __atomic_load_n(&c->error, __ATOMIC_ACQUIRE);
-        c->callback(c->hash, c->user_data, error);
-        free(c);
+
+        /* The callback may let the caller free the hash owning the pool, so
+         * we must release the completion first. */
+        release_completion(c);
+        callback(hash, user_data, error);
     }
 }
@@ -4,22 +4,158 @@
 #include <assert.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "blkhash-internal.h"
 #include "digest.h"
+#include "threads.h"
 #include "util.h"
 
-static int compute_zero_md(struct config *c)
+struct zero_md {
+    const char *digest_name;
+    uint32_t block_size;
+    unsigned md_len;
+    unsigned char md[BLKHASH_MAX_MD_SIZE];
+};
+
+/* Digests of a zero block for the default block size. */
+static const struct zero_md seeded[] = {
+    {
+        .digest_name = "sha256",
+        .block_size = 64 * KiB,
+        .md_len = 32,
+        .md = {
+            0xde, 0x2f, 0x25, 0x60, 0x64, 0xa0, 0xaf, 0x79,
+            0x77, 0x47, 0xc2, 0xb9, 0x75, 0x05, 0xdc, 0x0b,
+            0x9f, 0x3d, 0xf0, 0xde, 0x4f, 0x48, 0x9e, 0xac,
+            0x73, 0x1c, 0x23, 0xae, 0x9c, 0xa9, 0xcc, 0x31,
+        },
+    },
+#ifdef HAVE_BLAKE3
+    {
+        .digest_name = "blake3",
+        .block_size = 64 * KiB,
+        .md_len = 32,
+        .md = {
+            0x3b, 0xde, 0xaf, 0x8f, 0x8e, 0x98, 0x78, 0x0b,
+            0x31, 0x81, 0x06, 0xaa, 0xfd, 0xc3, 0xca, 0x25,
+            0x7f, 0x73, 0xdf, 0x12, 0x3d, 0x97, 0xb6, 0x91,
+            0x12, 0xb2, 0x60, 0x44, 0xc9, 0x1a, 0x7d, 0x56,
+        },
+    },
+#endif
+};
+
+struct cache_entry {
+    struct cache_entry *next;
+    struct zero_md value;
+};
+
+/*
+ * Process-wide cache of computed zero block digests. Entries are added when
+ * creating a hash with a new digest and block size, and are never removed.
+ */
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct cache_entry *cache;
+
+static bool zero_md_matches(const struct zero_md *z,
+                            const struct config_digest *d,
+                            uint32_t block_size)
+{
+    return z->block_size == block_size &&
+        strcmp(z->digest_name, d->name) == 0;
+}
+
+static void use_zero_md(struct config_digest *d, const struct zero_md *z)
+{
+    memcpy(d->zero_md, z->md, z->md_len);
+    d->md_len = z->md_len;
+}
+
+static bool lookup_zero_md(struct config_digest *d, uint32_t block_size)
+{
+    struct cache_entry *e;
+    bool found = false;
+
+    for (unsigned i = 0; i < ARRAY_SIZE(seeded); i++) {
+        if (zero_md_matches(&seeded[i], d, block_size)) {
+            use_zero_md(d, &seeded[i]);
+            return true;
+        }
+    }
+
+    mutex_lock(&cache_mutex);
+
+    for (e = cache; e; e = e->next) {
+        if (zero_md_matches(&e->value, d, block_size)) {
+            use_zero_md(d, &e->value);
+            found = true;
+            break;
+        }
+    }
+
+    mutex_unlock(&cache_mutex);
+
+    return found;
+}
+
+static void add_zero_md(const struct config_digest *d, uint32_t block_size)
+{
+    struct cache_entry *e;
+    char *name;
+
+    /* Caching is optional, we can ignore allocation failures. */
+    e = malloc(sizeof(*e));
+    if (e == NULL)
+        return;
+
+    name = strdup(d->name);
+    if (name == NULL) {
+        free(e);
+        return;
+    }
+
+    e->value.digest_name = name;
+    e->value.block_size = block_size;
+    e->value.md_len = d->md_len;
+    memcpy(e->value.md, d->zero_md, d->md_len);
+
+    mutex_lock(&cache_mutex);
+
+    /* If another thread added the same entry, we keep both; the value is the
+     * same and lookup returns the first. */
+    e->next = cache;
+    cache = e;
+
+    mutex_unlock(&cache_mutex);
+}
+
+__attribute__ ((destructor))
+static void clear_zero_md_cache(void)
+{
+    struct cache_entry *e;
+
+    while ((e = cache)) {
+        cache = e->next;
+        free((char *)e->value.digest_name);
+        free(e);
+    }
+}
+
+static int compute_zero_md(struct config_digest *d, uint32_t block_size)
 {
     unsigned char *buf;
     struct digest *digest = NULL;
     int err;
 
-    buf = calloc(1, c->block_size);
+    if (lookup_zero_md(d, block_size))
+        return 0;
+
+    buf = calloc(1, block_size);
     if (buf == NULL)
         return errno;
 
-    err = -digest_create(c->digest_name, &digest);
+    err = -digest_create(d->name, &digest);
     if (err)
         goto out;
 
@@ -27,11 +163,15 @@ static int compute_zero_md(struct config *c)
     if (err)
         goto out;
 
-    err = -digest_update(digest, buf, c->block_size);
+    err = -digest_update(digest, buf, block_size);
     if (err)
         goto out;
 
-    err = -digest_final(digest, c->zero_md, &c->md_len);
+    err = -digest_final(digest, d->zero_md, &d->md_len);
+    if (err)
+        goto out;
+
+    add_zero_md(d, block_size);
 
 out:
     digest_destroy(digest);
@@ -42,13 +182,25 @@ out:
 
 int config_init(struct config *c, const struct blkhash_opts *opts)
 {
-    c->digest_name = opts->digest_name;
+    int err;
+
     c->block_size = opts->block_size;
     c->workers = opts->threads;
+    c->min_workers = opts->min_threads;
     c->queue_depth = opts->queue_depth;
+    c->zero_copy = opts->zero_copy;
+    c->cpus = opts->cpus;
 
     /* XXX Initial value, needs testing */
     c->max_submissions = MAX(MAX(c->queue_depth, c->workers) * 4, 32);
 
-    return compute_zero_md(c);
+    c->digests_count = opts->digests_count;
+    for (unsigned i = 0; i < c->digests_count; i++) {
+        c->digests[i].name = opts->digest_names[i];
+        err = compute_zero_md(&c->digests[i], c->block_size);
+        if (err)
+            return err;
+    }
+
+    return 0;
 }
@@ -0,0 +1,162 @@
+// SPDX-FileCopyrightText: Red Hat Inc
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+/*
+ * SHA digests using the low level APIs, used only when the hash state must
+ * be saved and loaded. The EVP APIs do not provide access to the state, and
+ * the low level APIs are deprecated since OpenSSL 3.0.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define OPENSSL_SUPPRESS_DEPRECATED
+
+#include <openssl/sha.h>
+
+#include "digest.h"
+#include "util.h"
+
+struct sha_algorithm {
+    const char *name;
+    size_t ctx_size;
+    int (*init)(void *ctx);
+    int (*update)(void *ctx, const void *data, size_t len);
+    int (*final)(unsigned char *md, void *ctx);
+    unsigned md_len;
+};
+
+#define SHA_ALGORITHM(NAME, FUNC, CTX, LEN)                             \
+    static int FUNC##_init(void *c) { return FUNC##_Init(c); }          \
+    static int FUNC##_update(void *c, const void *data, size_t len)     \
+        { return FUNC##_Update(c, data, len); }                         \
+    static int FUNC##_final(unsigned char *md, void *c)                 \
+        { return FUNC##_Final(md, c); }                                 \
+    static const struct sha_algorithm FUNC##_algorithm = {              \
+        .name = NAME,                                                   \
+        .ctx_size = sizeof(CTX),                                        \
+        .init = FUNC##_init,                                            \
+        .update = FUNC##_update,                                        \
+        .final = FUNC##_final,                                          \
+        .md_len = LEN,                                                  \
+    }
+
+SHA_ALGORITHM("sha1", SHA1, SHA_CTX, SHA_DIGEST_LENGTH);
+SHA_ALGORITHM("sha224", SHA224, SHA256_CTX, SHA224_DIGEST_LENGTH);
+SHA_ALGORITHM("sha256", SHA256, SHA256_CTX, SHA256_DIGEST_LENGTH);
+SHA_ALGORITHM("sha384", SHA384, SHA512_CTX, SHA384_DIGEST_LENGTH);
+SHA_ALGORITHM("sha512", SHA512, SHA512_CTX, SHA512_DIGEST_LENGTH);
+
+static const struct sha_algorithm *sha_algorithms[] = {
+    &SHA1_algorithm,
+    &SHA224_algorithm,
+    &SHA256_algorithm,
+    &SHA384_algorithm,
+    &SHA512_algorithm,
+};
+
+struct sha_digest {
+    struct digest digest;
+    const struct sha_algorithm *algorithm;
+    union {
+        SHA_CTX sha1;
+        SHA256_CTX sha256;
+        SHA512_CTX sha512;
+    } ctx;
+};
+
+static int sha_init(struct digest *d)
+{
+    struct sha_digest *s = (struct sha_digest *)d;
+
+    if (!s->algorithm->init(&s->ctx))
+        return -ENOMEM;
+
+    return 0;
+}
+
+static int sha_update(struct digest *d, const void *data, size_t len)
+{
+    struct sha_digest *s = (struct sha_digest *)d;
+
+    if (!s->algorithm->update(&s->ctx, data, len))
+        return -ENOMEM;
+
+    return 0;
+}
+
+static int sha_final(struct digest *d, unsigned char *md, unsigned int *len)
+{
+    struct sha_digest *s = (struct sha_digest *)d;
+
+    if (!s->algorithm->final(md, &s->ctx))
+        return -ENOMEM;
+
+    if (len)
+        *len = s->algorithm->md_len;
+
+    return 0;
+}
+
+static size_t sha_state_size(struct digest *d)
+{
+    struct sha_digest *s = (struct sha_digest *)d;
+    return s->algorithm->ctx_size;
+}
+
+static int sha_save_state(struct digest *d, void *out)
+{
+    struct sha_digest *s = (struct sha_digest *)d;
+    memcpy(out, &s->ctx, s->algorithm->ctx_size);
+    return 0;
+}
+
+static int sha_load_state(struct digest *d, const void *in)
+{
+    struct sha_digest *s = (struct sha_digest *)d;
+    memcpy(&s->ctx, in, s->algorithm->ctx_size);
+    return 0;
+}
+
+static void sha_destroy(struct digest *d)
+{
+    free(d);
+}
+
+static struct digest_ops sha_ops = {
+    .init = sha_init,
+    .update = sha_update,
+    .finalize = sha_final,
+    .state_size = sha_state_size,
+    .save_state = sha_save_state,
+    .load_state = sha_load_state,
+    .destroy = sha_destroy,
+};
+
+static int create_sha(const struct sha_algorithm *algorithm,
+                      struct digest **out)
+{
+    struct sha_digest *s;
+
+    s = calloc(1, sizeof(*s));
+    if (s == NULL)
+        return -errno;
+
+    s->digest.ops = &sha_ops;
+    s->algorithm = algorithm;
+
+    *out = &s->digest;
+    return 0;
+}
+
+int digest_create_resumable(const char *name, struct digest **out)
+{
+    for (unsigned i = 0; i < ARRAY_SIZE(sha_algorithms); i++) {
+        if (strcasecmp(name, sha_algorithms[i]->name) == 0)
+            return create_sha(sha_algorithms[i], out);
+    }
+
+    return digest_create(name, out);
+}
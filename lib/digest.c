@@ -9,6 +9,7 @@
 
 #include "blkhash-config.h"
 #include "digest.h"
+#include "sha256-mb.h"
 
 #ifdef HAVE_BLAKE3
 
@@ -42,6 +43,26 @@ static int blake3_ops_final(struct digest *d, unsigned char *out, unsigned int *
     return 0;
 }
 
+static size_t blake3_ops_state_size(struct digest *d)
+{
+    (void)d;
+    return sizeof(blake3_hasher);
+}
+
+static int blake3_ops_save_state(struct digest *d, void *out)
+{
+    struct blake3_digest *b = (struct blake3_digest *)d;
+    memcpy(out, &b->hasher, sizeof(b->hasher));
+    return 0;
+}
+
+static int blake3_ops_load_state(struct digest *d, const void *in)
+{
+    struct blake3_digest *b = (struct blake3_digest *)d;
+    memcpy(&b->hasher, in, sizeof(b->hasher));
+    return 0;
+}
+
 static void blake3_ops_destroy(struct digest *d)
 {
     free(d);
@@ -51,6 +72,9 @@ static struct digest_ops blake3_ops = {
     .init = blake3_ops_init,
     .update = blake3_ops_update,
     .finalize = blake3_ops_final,
+    .state_size = blake3_ops_state_size,
+    .save_state = blake3_ops_save_state,
+    .load_state = blake3_ops_load_state,
     .destroy = blake3_ops_destroy,
 };
 
@@ -92,6 +116,26 @@ static int null_final(struct digest *d, unsigned char *out, unsigned int *len)
     return 0;
 }
 
+static size_t null_state_size(struct digest *d)
+{
+    (void)d;
+    return 0;
+}
+
+static int null_save_state(struct digest *d, void *out)
+{
+    (void)d;
+    (void)out;
+    return 0;
+}
+
+static int null_load_state(struct digest *d, const void *in)
+{
+    (void)d;
+    (void)in;
+    return 0;
+}
+
 static void null_destroy(struct digest *d)
 {
     (void)d;
@@ -101,6 +145,9 @@ static struct digest_ops null_ops = {
     .init = null_init,
     .update = null_update,
     .finalize = null_final,
+    .state_size = null_state_size,
+    .save_state = null_save_state,
+    .load_state = null_load_state,
     .destroy = null_destroy,
 };
 
@@ -207,11 +254,133 @@ error:
     return err;
 }
 
+/*
+ * SHA-256 using multi-buffer hashing for blocks, and EVP for everything
+ * else.
+ */
+struct sha256_mb_digest {
+    struct digest digest;
+    struct digest *evp;
+};
+
+static int sha256_mb_init(struct digest *d)
+{
+    struct sha256_mb_digest *mb = (struct sha256_mb_digest *)d;
+    return digest_init(mb->evp);
+}
+
+static int sha256_mb_update(struct digest *d, const void *data, size_t len)
+{
+    struct sha256_mb_digest *mb = (struct sha256_mb_digest *)d;
+    return digest_update(mb->evp, data, len);
+}
+
+static int sha256_mb_final(struct digest *d, unsigned char *md,
+                           unsigned int *len)
+{
+    struct sha256_mb_digest *mb = (struct sha256_mb_digest *)d;
+    return digest_final(mb->evp, md, len);
+}
+
+static void sha256_mb_destroy(struct digest *d)
+{
+    struct sha256_mb_digest *mb = (struct sha256_mb_digest *)d;
+
+    digest_destroy(mb->evp);
+    free(mb);
+}
+
+static int sha256_mb_hash_many(struct digest *d, const void **blocks,
+                               const size_t *lens, unsigned char **mds,
+                               unsigned n)
+{
+    struct sha256_mb_digest *mb = (struct sha256_mb_digest *)d;
+    unsigned start = 0;
+
+    /* Hash runs of blocks with the same length together. */
+    for (unsigned i = 1; i <= n; i++) {
+        if (i < n && lens[i] == lens[start])
+            continue;
+
+        if (i - start == 1) {
+            int err = digest_hash_many(mb->evp, &blocks[start], &lens[start],
+                                       &mds[start], 1);
+            if (err)
+                return err;
+        } else {
+            sha256_mb(&blocks[start], lens[start], i - start, &mds[start]);
+        }
+
+        start = i;
+    }
+
+    return 0;
+}
+
+static struct digest_ops sha256_mb_ops = {
+    .init = sha256_mb_init,
+    .update = sha256_mb_update,
+    .finalize = sha256_mb_final,
+    .hash_many = sha256_mb_hash_many,
+    .destroy = sha256_mb_destroy,
+};
+
+static int create_sha256_mb(struct digest **out)
+{
+    struct sha256_mb_digest *mb;
+    int err;
+
+    mb = calloc(1, sizeof(*mb));
+    if (mb == NULL)
+        return -errno;
+
+    err = create_evp("sha256", &mb->evp);
+    if (err) {
+        free(mb);
+        return err;
+    }
+
+    mb->digest.ops = &sha256_mb_ops;
+    mb->digest.lanes = SHA256_MB_LANES;
+
+    *out = &mb->digest;
+    return 0;
+}
+
+int digest_hash_many(struct digest *d, const void **blocks,
+                     const size_t *lens, unsigned char **mds, unsigned n)
+{
+    int err;
+
+    if (d->ops->hash_many)
+        return d->ops->hash_many(d, blocks, lens, mds, n);
+
+    for (unsigned i = 0; i < n; i++) {
+        err = digest_init(d);
+        if (err)
+            return err;
+
+        err = digest_update(d, blocks[i], lens[i]);
+        if (err)
+            return err;
+
+        err = digest_final(d, mds[i], NULL);
+        if (err)
+            return err;
+    }
+
+    return 0;
+}
+
 int digest_create(const char *name, struct digest **out)
 {
     if (strcmp(name, "null") == 0)
         return create_null(out);
 
+    /* Selected at runtime, using the CPU features. */
+    if (strcmp(name, "sha256") == 0 && sha256_mb_supported())
+        return create_sha256_mb(out);
+
 #ifdef HAVE_BLAKE3
     if (strcmp(name, "blake3") == 0)
         return create_blake3(out);
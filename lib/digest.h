@@ -4,23 +4,48 @@
 #ifndef DIGEST_H
 #define DIGEST_H
 
+#include <errno.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <unistd.h>
 
+/* Maximum number of blocks passed to digest_hash_many() by the workers. */
+#define DIGEST_MAX_LANES 8
+
 struct digest {
     struct digest_ops *ops;
+
+    /* Number of blocks the digest hashes efficiently in one hash_many()
+     * call. Used only if the digest implements hash_many(). */
+    unsigned lanes;
 };
 
 struct digest_ops {
     int (*init)(struct digest *d);
     int (*update)(struct digest *d, const void *data, size_t len);
     int (*finalize)(struct digest *d, unsigned char *out, unsigned int *len);
+
+    /* Optional, compute the digests of n independent blocks. */
+    int (*hash_many)(struct digest *d, const void **blocks,
+                     const size_t *lens, unsigned char **mds, unsigned n);
+
+    /* Optional, copy the internal state to out, or restore the state. */
+    size_t (*state_size)(struct digest *d);
+    int (*save_state)(struct digest *d, void *out);
+    int (*load_state)(struct digest *d, const void *in);
+
     void (*destroy)(struct digest *d);
 };
 
 /* Lookup name and create a new digest. */
 int digest_create(const char *name, struct digest **out);
 
+/*
+ * Like digest_create(), but create a digest supporting saving and loading
+ * the state if possible.
+ */
+int digest_create_resumable(const char *name, struct digest **out);
+
 /* Initialize a digest for computing a new hash. */
 static inline int digest_init(struct digest *d)
 {
@@ -39,6 +64,54 @@ static inline int digest_final(struct digest *d, unsigned char *out, unsigned in
     return d->ops->finalize(d, out, len);
 }
 
+/* Return true if the digest can hash many blocks in one call. */
+static inline bool digest_has_hash_many(struct digest *d)
+{
+    return d->ops->hash_many != NULL;
+}
+
+/*
+ * Compute the digests of n blocks, storing the digest of blocks[i] of
+ * lens[i] bytes in mds[i]. If the digest does not implement hash_many(),
+ * hash one block at a time.
+ */
+int digest_hash_many(struct digest *d, const void **blocks,
+                     const size_t *lens, unsigned char **mds, unsigned n);
+
+/* Return true if the digest state can be saved and loaded. */
+static inline bool digest_is_resumable(struct digest *d)
+{
+    return d->ops->save_state != NULL;
+}
+
+/* Return the size of the state saved by digest_save_state(). */
+static inline size_t digest_state_size(struct digest *d)
+{
+    return d->ops->state_size(d);
+}
+
+/*
+ * Save the internal state of the digest in out, which must have room for
+ * digest_state_size() bytes. The state can be loaded only by the same
+ * library build.
+ */
+static inline int digest_save_state(struct digest *d, void *out)
+{
+    if (d->ops->save_state == NULL)
+        return -ENOTSUP;
+
+    return d->ops->save_state(d, out);
+}
+
+/* Restore the state saved by digest_save_state(). */
+static inline int digest_load_state(struct digest *d, const void *in)
+{
+    if (d->ops->load_state == NULL)
+        return -ENOTSUP;
+
+    return d->ops->load_state(d, in);
+}
+
 /* Free resources allocated by digest_create(). */
 static inline void digest_destroy(struct digest *d)
 {
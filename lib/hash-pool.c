@@ -2,71 +2,220 @@
 // SPDX-License-Identifier: LGPL-2.1-or-later
 
 #include <errno.h>
+#include <string.h>
 
 #include "blkhash-internal.h"
 #include "digest.h"
 #include "hash-pool.h"
 #include "submission.h"
 #include "threads.h"
+#include "util.h"
 
-static struct submission *STOP = (struct submission *)-1;
+/* Minimal time between autoscaling checks. */
+#define AUTOSCALE_INTERVAL_USEC 20000
 
-static void set_error(struct hash_pool *p, int error)
+static inline unsigned active_workers(struct hash_pool *p)
 {
-    mutex_lock(&p->mutex);
+    return __atomic_load_n(&p->workers_active, __ATOMIC_RELAXED);
+}
+
+static inline bool is_parked(struct worker *w)
+{
+    return __atomic_load_n(&w->parked, __ATOMIC_SEQ_CST);
+}
 
-    /* Keep the first error. */
-    if (p->error == 0)
-        p->error = error;
+static inline void set_parked(struct worker *w, bool value)
+{
+    struct hash_pool *p = w->pool;
 
-    mutex_unlock(&p->mutex);
+    __atomic_store_n(&w->parked, value, __ATOMIC_SEQ_CST);
+
+    if (value)
+        __atomic_add_fetch(&p->workers_idle, 1, __ATOMIC_SEQ_CST);
+    else
+        __atomic_sub_fetch(&p->workers_idle, 1, __ATOMIC_SEQ_CST);
 }
 
-static inline void push_unlocked(struct hash_pool *p, struct submission *sub)
+/*
+ * Must be called after taking a submission from a queue, without holding the
+ * pool mutex. Pairs with the fence in wait_for_space(); either the submitter
+ * sees the free slot, or we see that it is waiting and wake it up after it
+ * started to wait.
+ */
+static inline void space_available(struct hash_pool *p)
 {
-    p->queue[p->queue_tail] = sub;
-    p->queue_tail = (p->queue_tail + 1) % p->queue_size;
-    p->queue_len++;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&p->submitters_waiting, __ATOMIC_SEQ_CST)) {
+        mutex_lock(&p->mutex);
+        cond_broadcast(&p->space);
+        mutex_unlock(&p->mutex);
+    }
 }
 
-static inline struct submission *pop_unlocked(struct hash_pool *p)
+/*
+ * Take a submission from our queue, or steal one from another worker. Workers
+ * are scanned starting with our neighbour so thieves do not compete on the
+ * same victim.
+ */
+static struct submission *find_work(struct worker *w)
 {
+    struct hash_pool *p = w->pool;
     struct submission *sub;
+    unsigned count;
 
-    sub = p->queue[p->queue_head];
-    p->queue_head = (p->queue_head + 1) % p->queue_size;
-    p->queue_len--;
+    sub = ring_pop(&w->queue);
+    if (sub)
+        return sub;
 
-    return sub;
+    /* Inactive workers only drain their own queue. */
+    if (w->id >= active_workers(p))
+        return NULL;
+
+    /* Workers are started while initializing the pool. */
+    count = __atomic_load_n(&p->workers_count, __ATOMIC_ACQUIRE);
+
+    for (unsigned i = 1; i < count; i++) {
+        struct worker *victim = &p->workers[(w->id + i) % count];
+
+        sub = ring_pop(&victim->queue);
+        if (sub)
+            return sub;
+    }
+
+    return NULL;
 }
 
-static struct submission *wait_for_work(struct hash_pool *p)
+/*
+ * Return the next submission, or NULL if the pool is stopping.
+ */
+static struct submission *wait_for_work(struct worker *w)
 {
+    struct hash_pool *p = w->pool;
     struct submission *sub;
 
+    /* Fast path, we have work. */
+    sub = find_work(w);
+    if (sub) {
+        space_available(p);
+        return sub;
+    }
+
     mutex_lock(&p->mutex);
 
-    while (p->queue_len == 0) {
-        p->workers_idle++;
-        cond_wait(&p->not_empty, &p->mutex);
-        p->workers_idle--;
-    }
+    for (;;) {
+        /*
+         * Announce that we are parked before checking the queues again. This
+         * pairs with the fence in hash_pool_submit(); either we see the new
+         * submission, or the submitter sees that we are parked and wakes us
+         * up after we started to wait.
+         */
+        set_parked(w, true);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        sub = find_work(w);
+        if (sub || __atomic_load_n(&p->stopping, __ATOMIC_SEQ_CST)) {
+            set_parked(w, false);
+            break;
+        }
 
-    sub = pop_unlocked(p);
+        /* The waker clears the parked flag. */
+        while (is_parked(w))
+            cond_wait(&w->wakeup, &p->mutex);
+    }
 
     mutex_unlock(&p->mutex);
 
+    if (sub)
+        space_available(p);
+
     return sub;
 }
 
-static bool is_zero_block(struct hash_pool *p, const struct submission *sub)
+/* Must be called with the pool mutex held. */
+static inline void wake_up_locked(struct worker *w)
+{
+    if (is_parked(w)) {
+        set_parked(w, false);
+        cond_signal(&w->wakeup);
+    }
+}
+
+static bool is_zero_block(const struct submission *sub)
 {
     return !(sub->flags & SUBMIT_COPY_DATA) &&
-        sub->len == p->config->block_size &&
+        sub->len == sub->config->block_size &&
         is_zero(sub->data, sub->len);
 }
 
-static void compute_block_digest(struct submission *sub, struct digest *digest)
+/* Return the cached digest for digest name, or NULL if not cached. */
+static struct digest *find_digest(struct worker *w, const char *name)
+{
+    for (unsigned i = 0; i < w->digests_count; i++) {
+        if (strcmp(w->digests[i].name, name) == 0)
+            return w->digests[i].digest;
+    }
+
+    return NULL;
+}
+
+/*
+ * Return a digest for digest name, creating a new digest if needed. If the
+ * cache is full, the oldest digest is replaced.
+ */
+static int get_digest(struct worker *w, const char *name, struct digest **out)
+{
+    struct worker_digest *wd;
+    struct digest *digest;
+    char *copy;
+    int err;
+
+    digest = find_digest(w, name);
+    if (digest) {
+        *out = digest;
+        return 0;
+    }
+
+    err = -digest_create(name, &digest);
+    if (err)
+        return err;
+
+    /* The name is owned by the hash, which may be freed before the pool. */
+    copy = strdup(name);
+    if (copy == NULL) {
+        err = errno;
+        digest_destroy(digest);
+        return err;
+    }
+
+    if (w->digests_count < WORKER_DIGESTS) {
+        wd = &w->digests[w->digests_count++];
+    } else {
+        wd = &w->digests[w->next_digest];
+        w->next_digest = (w->next_digest + 1) % WORKER_DIGESTS;
+        digest_destroy(wd->digest);
+        free(wd->name);
+    }
+
+    wd->name = copy;
+    wd->digest = digest;
+
+    *out = digest;
+    return 0;
+}
+
+static void destroy_digests(struct worker *w)
+{
+    for (unsigned i = 0; i < w->digests_count; i++) {
+        digest_destroy(w->digests[i].digest);
+        free(w->digests[i].name);
+    }
+
+    w->digests_count = 0;
+}
+
+static void compute_block_digest(struct submission *sub, struct digest *digest,
+                                 unsigned char *md)
 {
     int err;
 
@@ -78,7 +227,7 @@ static void compute_block_digest(struct submission *sub, struct digest *digest)
     if (err)
         goto error;
 
-    err = -digest_final(digest, sub->md, NULL);
+    err = -digest_final(digest, md, NULL);
     if (err)
         goto error;
 
@@ -88,184 +237,525 @@ error:
     submission_set_error(sub, err);
 }
 
-static void *worker_thread(void *arg)
+/*
+ * Return true if the submission uses digest. Must not access the hash of
+ * other submissions, which may be freed once they are completed.
+ */
+static inline bool uses_digest(struct worker *w, const struct submission *sub,
+                               const struct digest *digest)
 {
-    struct hash_pool *p = arg;
-    struct submission *sub;
+    return sub->config->digests_count == 1 &&
+        find_digest(w, sub->config->digests[0].name) == digest;
+}
+
+/*
+ * Hash the submission and up to lanes - 1 submissions from our queue using
+ * the same digest in one hash_many() call. Zero blocks are handled
+ * separately.
+ *
+ * Return the next submission if it uses a different digest.
+ */
+static struct submission *hash_many_blocks(struct worker *w,
+                                           struct submission *sub,
+                                           struct digest *digest)
+{
+    struct submission *subs[DIGEST_MAX_LANES];
+    const void *blocks[DIGEST_MAX_LANES];
+    size_t lens[DIGEST_MAX_LANES];
+    unsigned char *mds[DIGEST_MAX_LANES];
+    struct submission *next = NULL;
+    bool popped = false;
+    unsigned lanes = digest->lanes ? MIN(digest->lanes, DIGEST_MAX_LANES)
+                                   : DIGEST_MAX_LANES;
+    unsigned count = 0;
+    int err;
+
+    for (;;) {
+        if (!uses_digest(w, sub, digest)) {
+            next = sub;
+            break;
+        }
+
+        if (is_zero_block(sub)) {
+            submission_set_zero(sub);
+            submission_complete(sub);
+        } else {
+            subs[count] = sub;
+            blocks[count] = sub->data;
+            lens[count] = sub->len;
+            mds[count] = sub->md[0];
+            count++;
+        }
+
+        if (count == lanes)
+            break;
+
+        /* Do not steal more work, other workers may be idle. */
+        sub = ring_pop(&w->queue);
+        if (sub == NULL)
+            break;
+
+        popped = true;
+    }
+
+    if (popped)
+        space_available(w->pool);
+
+    if (count == 1) {
+        compute_block_digest(subs[0], digest, subs[0]->md[0]);
+    } else if (count > 1) {
+        err = -digest_hash_many(digest, blocks, lens, mds, count);
+        if (err) {
+            for (unsigned i = 0; i < count; i++)
+                submission_set_error(subs[i], err);
+        }
+    }
+
+    for (unsigned i = 0; i < count; i++)
+        submission_complete(subs[i]);
+
+    return next;
+}
+
+/*
+ * Hash the block with all digests of the hash, while the data is in the
+ * cache.
+ */
+static void compute_block_digests(struct worker *w, struct submission *sub)
+{
+    const struct config *c = sub->config;
     struct digest *digest;
     int err;
 
-    err = digest_create(p->config->digest_name, &digest);
-    if (err) {
-        set_error(p, err);
-        return NULL;
+    for (unsigned i = 0; i < c->digests_count; i++) {
+        err = get_digest(w, c->digests[i].name, &digest);
+        if (err) {
+            submission_set_error(sub, err);
+            return;
+        }
+
+        compute_block_digest(sub, digest, sub->md[i]);
+        if (submission_error(sub))
+            return;
     }
+}
 
-    for (;;) {
-        sub = wait_for_work(p);
-        if (sub == STOP)
-            break;
+/*
+ * Hash the submission and complete it. Return the next submission to
+ * process, or NULL.
+ */
+static struct submission *hash_submission(struct worker *w,
+                                          struct submission *sub)
+{
+    struct digest *digest = NULL;
+    int err;
 
-        if (is_zero_block(p, sub))
+    if (sub->config->digests_count > 1) {
+        if (is_zero_block(sub))
             submission_set_zero(sub);
         else
-            compute_block_digest(sub, digest);
+            compute_block_digests(w, sub);
 
         submission_complete(sub);
+        return NULL;
+    }
+
+    /* If we cannot create a digest we must keep running, failing the
+     * submission. */
+    err = get_digest(w, sub->config->digests[0].name, &digest);
+    if (err) {
+        submission_set_error(sub, err);
+    } else if (digest_has_hash_many(digest)) {
+        return hash_many_blocks(w, sub, digest);
+    } else if (is_zero_block(sub)) {
+        submission_set_zero(sub);
+    } else {
+        compute_block_digest(sub, digest, sub->md[0]);
     }
 
-    digest_destroy(digest);
+    submission_complete(sub);
+
+    return NULL;
+}
+
+static void *worker_thread(void *arg)
+{
+    struct worker *w = arg;
+    struct submission *sub;
+
+    while ((sub = wait_for_work(w))) {
+        do {
+            sub = hash_submission(w, sub);
+        } while (sub);
+    }
+
+    destroy_digests(w);
 
     return NULL;
 }
 
 static void stop_workers(struct hash_pool *p)
 {
-    mutex_lock(&p->mutex);
+    struct submission *sub;
 
     /* New sumissions will fail with EIO. */
     p->stopped = true;
 
-    /* Clear the queue, failing all queued submissions. */
-    while (p->queue_len > 0) {
-        struct submission *sub = pop_unlocked(p);
-        submission_set_error(sub, EIO);
-        submission_complete(sub);
-    }
+    /* Workers terminate when they do not find more work. */
+    __atomic_store_n(&p->stopping, true, __ATOMIC_SEQ_CST);
 
-    /* Add STOP submission for every worker. */
+    /* Clear the queues, failing all queued submissions. */
     for (unsigned i = 0; i < p->workers_count; i++) {
-        push_unlocked(p, STOP);
+        while ((sub = ring_pop(&p->workers[i].queue))) {
+            submission_set_error(sub, EIO);
+            submission_complete(sub);
+        }
     }
 
-    /* Wake up all workers and wait until they terminate. */
-    cond_broadcast(&p->not_empty);
+    /* Wake up all workers and submitters and wait until workers terminate. */
+    mutex_lock(&p->mutex);
+    for (unsigned i = 0; i < p->workers_count; i++)
+        wake_up_locked(&p->workers[i]);
+    cond_broadcast(&p->space);
+    mutex_unlock(&p->mutex);
 
-    for (unsigned i = 0; i < p->workers_count; i++) {
-        mutex_unlock(&p->mutex);
-        pthread_join(p->workers[i], NULL);
-        mutex_lock(&p->mutex);
+    for (unsigned i = 0; i < p->workers_count; i++)
+        pthread_join(p->workers[i].thread, NULL);
+}
+
+static void destroy_worker(struct worker *w)
+{
+    cond_destroy(&w->wakeup);
+    ring_destroy(&w->queue);
+}
+
+static int init_worker(struct hash_pool *p, unsigned id, unsigned queue_size,
+                       const struct cpu_mask *cpus)
+{
+    struct worker *w = &p->workers[id];
+    int err;
+
+    w->pool = p;
+    w->id = id;
+    w->parked = false;
+    w->digests_count = 0;
+    w->next_digest = 0;
+
+    err = ring_init(&w->queue, queue_size);
+    if (err)
+        return err;
+
+    err = pthread_cond_init(&w->wakeup, NULL);
+    if (err) {
+        ring_destroy(&w->queue);
+        return err;
     }
 
-    mutex_unlock(&p->mutex);
+    err = cpu_mask_thread_create(&w->thread, cpus, worker_thread, w);
+    if (err) {
+        destroy_worker(w);
+        return err;
+    }
+
+    return 0;
+}
+
+static void destroy_workers(struct hash_pool *p)
+{
+    for (unsigned i = 0; i < p->workers_count; i++)
+        destroy_worker(&p->workers[i]);
+
+    free(p->workers);
+    p->workers = NULL;
 }
 
-int hash_pool_init(struct hash_pool *p, const struct config *config)
+int hash_pool_init(struct hash_pool *p, unsigned workers, unsigned queue_size,
+                   const struct cpu_mask *cpus)
 {
     int err;
 
-    p->config = config;
-    p->queue_size = config->max_submissions;
-    p->queue_len = 0;
-    p->queue_head = 0;
-    p->queue_tail = 0;
     p->workers_count = 0;
+    p->workers_active = workers;
     p->workers_idle = 0;
+    p->submitters_waiting = 0;
+    p->next_worker = 0;
+    p->stopping = false;
     p->stopped = false;
-    p->error = 0;
+    memset(&p->autoscale, 0, sizeof(p->autoscale));
 
-    p->queue = calloc(p->queue_size, sizeof(*p->queue));
-    if (p->queue == NULL)
+    p->workers = calloc(workers, sizeof(*p->workers));
+    if (p->workers == NULL)
         return errno;
 
-    p->workers = calloc(config->workers, sizeof(*p->workers));
-    if (p->workers == NULL) {
-        err = errno;
-        goto fail_workers;
-    }
-
     err = pthread_mutex_init(&p->mutex, NULL);
     if (err)
         goto fail_mutex;
 
-    err = pthread_cond_init(&p->not_empty, NULL);
+    err = pthread_cond_init(&p->space, NULL);
     if (err)
-        goto fail_not_empty;
+        goto fail_cond;
 
-    for (unsigned i = 0; i < config->workers; i++) {
-        err = pthread_create(&p->workers[i], NULL, worker_thread, p);
+    for (unsigned i = 0; i < workers; i++) {
+        err = init_worker(p, i, queue_size, cpus);
         if (err)
-            goto fail_thread;
+            goto fail_worker;
 
-        p->workers_count++;
+        __atomic_store_n(&p->workers_count, i + 1, __ATOMIC_RELEASE);
     }
 
     return 0;
 
-fail_thread:
+fail_worker:
     stop_workers(p);
-    pthread_cond_destroy(&p->not_empty);
-fail_not_empty:
+    destroy_workers(p);
+    cond_destroy(&p->space);
     pthread_mutex_destroy(&p->mutex);
+
+    return err;
+
+fail_cond:
+    pthread_mutex_destroy(&p->mutex);
+
 fail_mutex:
     free(p->workers);
-fail_workers:
-    free(p->queue);
+    p->workers = NULL;
 
     return err;
 }
 
-static inline unsigned active_workers(struct hash_pool *p)
+/*
+ * Wake up parked workers owning queues with work. If busy workers have a
+ * backlog, wake up more parked workers to steal from them, up to the number
+ * of new submissions.
+ *
+ * If the queues do not have enough work it is better to let idle workers
+ * sleep little bit to avoid waking up a worker for for every cycle.
+ */
+static void maybe_wake_up(struct hash_pool *p, unsigned count)
 {
-    return p->workers_count - p->workers_idle;
+    unsigned backlog = 0;
+
+    /* Pairs with set_parked() in wait_for_work(), if nobody is parked yet,
+     * the workers will find the new submissions. */
+    if (__atomic_load_n(&p->workers_idle, __ATOMIC_SEQ_CST) == 0)
+        return;
+
+    mutex_lock(&p->mutex);
+
+    for (unsigned i = 0; i < p->workers_count && count > 0; i++) {
+        struct worker *w = &p->workers[i];
+        unsigned len = ring_len(&w->queue);
+
+        if (len == 0)
+            continue;
+
+        if (is_parked(w)) {
+            wake_up_locked(w);
+            count--;
+        } else if (len >= 2) {
+            backlog += len - 1;
+        }
+    }
+
+    count = MIN(count, backlog);
+
+    /* Inactive workers do not steal. */
+    for (unsigned i = 0; i < active_workers(p) && count > 0; i++) {
+        struct worker *thief = &p->workers[i];
+
+        if (is_parked(thief)) {
+            wake_up_locked(thief);
+            count--;
+        }
+    }
+
+    mutex_unlock(&p->mutex);
 }
 
 /*
- * If the queue does not have enough work it is better to let idle workers
- * sleep little bit to avoid waking up a worker for for every cycle.
+ * Push submission to the next active worker queue in round robin order. If
+ * the queue is full, try the next queues. Return false if all queues are
+ * full.
  */
-static inline bool need_wakeup(struct hash_pool *p)
+static bool push_submission(struct hash_pool *p, struct submission *sub)
 {
-    return p->workers_idle > 0 && p->queue_len > active_workers(p);
+    unsigned active = active_workers(p);
+
+    for (unsigned i = 0; i < active; i++) {
+        unsigned n = __atomic_fetch_add(&p->next_worker, 1, __ATOMIC_RELAXED);
+        struct worker *w = &p->workers[n % active];
+
+        if (ring_push(&w->queue, sub))
+            return true;
+    }
+
+    return false;
 }
 
-int hash_pool_submit(struct hash_pool *p, struct submission *sub)
+static bool has_space(struct hash_pool *p)
+{
+    unsigned active = active_workers(p);
+
+    for (unsigned i = 0; i < active; i++) {
+        struct ring *queue = &p->workers[i].queue;
+
+        if (ring_len(queue) <= queue->mask)
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Sleep until a worker takes a submission from a queue. Return EPERM if the
+ * pool is stopping.
+ */
+static int wait_for_space(struct hash_pool *p)
 {
     int err = 0;
 
     mutex_lock(&p->mutex);
 
+    /* Pairs with the fence in space_available(). */
+    __atomic_add_fetch(&p->submitters_waiting, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    for (;;) {
+        if (__atomic_load_n(&p->stopping, __ATOMIC_SEQ_CST)) {
+            err = EPERM;
+            break;
+        }
+
+        if (has_space(p))
+            break;
+
+        cond_wait(&p->space, &p->mutex);
+    }
+
+    __atomic_sub_fetch(&p->submitters_waiting, 1, __ATOMIC_SEQ_CST);
+
+    mutex_unlock(&p->mutex);
+
+    return err;
+}
+
+int hash_pool_submit_batch(struct hash_pool *p, struct submission **subs,
+                           unsigned count)
+{
+    unsigned pushed = 0;
+    unsigned unseen = 0;
+    int err = 0;
+
+    if (count == 0)
+        return 0;
+
     if (p->stopped) {
         err = EPERM;
         goto out;
     }
 
-    if (p->error) {
-        err = p->error;
-        goto out;
+    while (pushed < count) {
+        if (push_submission(p, subs[pushed])) {
+            pushed++;
+            unseen++;
+            continue;
+        }
+
+        /* All queues are full, possible only when the pool is shared by
+         * multiple hashes. Make sure the workers owning the queues are awake
+         * and wait until they make progress. */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        maybe_wake_up(p, p->workers_count);
+        unseen = 0;
+
+        err = wait_for_space(p);
+        if (err)
+            break;
     }
 
-    /* The queue can never be full since the submitter waits until the
-     * submission queue is not full. */
-    if (p->queue_len == p->queue_size) {
-        err = ENOBUFS;
-        goto out;
+    /* Pairs with the fence in wait_for_work(). */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    maybe_wake_up(p, unseen);
+
+out:
+    /* Fail the submissions we could not queue. */
+    for (unsigned i = pushed; i < count; i++) {
+        submission_set_error(subs[i], err);
+        submission_complete(subs[i]);
     }
 
-    push_unlocked(p, sub);
+    return err;
+}
 
-    if (need_wakeup(p))
-        cond_signal(&p->not_empty);
+int hash_pool_submit(struct hash_pool *p, struct submission *sub)
+{
+    return hash_pool_submit_batch(p, &sub, 1);
+}
 
-out:
-    mutex_unlock(&p->mutex);
+void hash_pool_enable_autoscale(struct hash_pool *p, unsigned min_workers)
+{
+    struct autoscale *as = &p->autoscale;
 
-    if (err) {
-        submission_set_error(sub, err);
-        submission_complete(sub);
+    as->enabled = true;
+    as->min_workers = MAX(MIN(min_workers, p->workers_count), 1);
+    as->max_workers = p->workers_count;
+    as->last_check = now_usec();
+    as->last_wait_usec = 0;
+
+    __atomic_store_n(&p->workers_active, as->min_workers, __ATOMIC_RELAXED);
+}
+
+void hash_pool_autoscale(struct hash_pool *p, uint64_t wait_usec)
+{
+    struct autoscale *as = &p->autoscale;
+    unsigned active = active_workers(p);
+    unsigned backlog = 0;
+    unsigned parked = 0;
+    uint64_t now, elapsed, waited;
+
+    if (!as->enabled)
+        return;
+
+    now = now_usec();
+    elapsed = now - as->last_check;
+    if (elapsed < AUTOSCALE_INTERVAL_USEC)
+        return;
+
+    waited = wait_usec - as->last_wait_usec;
+    as->last_check = now;
+    as->last_wait_usec = wait_usec;
+
+    for (unsigned i = 0; i < active; i++) {
+        struct worker *w = &p->workers[i];
+
+        backlog += ring_len(&w->queue);
+        if (is_parked(w))
+            parked++;
     }
 
-    return err;
+    if (parked == 0 && (waited * 10 > elapsed || backlog >= active * 2)) {
+        /* The workers cannot keep up; grow quickly. */
+        active = MIN(active + MAX(active / 4, 1), as->max_workers);
+    } else if (parked >= 2) {
+        /* More workers than needed; shrink slowly, since the next check may
+         * find more work. */
+        active = MAX(active - 1, as->min_workers);
+    }
+
+    __atomic_store_n(&p->workers_active, active, __ATOMIC_RELAXED);
 }
 
 int hash_pool_destroy(struct hash_pool *p)
 {
-    stop_workers(p);
+    /* Not initialized, or hash_pool_init() failed. */
+    if (p->workers == NULL)
+        return 0;
 
-    pthread_cond_destroy(&p->not_empty);
+    stop_workers(p);
+    destroy_workers(p);
+    cond_destroy(&p->space);
     pthread_mutex_destroy(&p->mutex);
-    free(p->workers);
-    free(p->queue);
 
     return 0;
 }
@@ -6,40 +6,140 @@
 
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "blkhash-config.h"
+#include "blkhash.h"
+#include "ring.h"
 
+/* Number of digests cached by every worker, enough for one hash using all
+ * digests, and some other hashes sharing the pool. */
+#define WORKER_DIGESTS (BLKHASH_MAX_DIGESTS * 2)
+
+struct cpu_mask;
+struct digest;
+struct submission;
+struct hash_pool;
+
+struct worker_digest {
+    char *name;
+    struct digest *digest;
+};
+
+struct worker {
+    /* Submissions queued for this worker. Other workers steal from this
+     * queue when they are idle. */
+    struct ring queue;
+
+    /* Signaled when work is queued for a parked worker. */
+    pthread_cond_t wakeup;
+
+    pthread_t thread;
+    struct hash_pool *pool;
+    unsigned int id;
+
+    /* Digests created by this worker, since submissions from different
+     * hashes may use different digests. Accessed only by the worker. */
+    struct worker_digest digests[WORKER_DIGESTS];
+    unsigned int digests_count;
+    unsigned int next_digest;
+
+    /* Set when the worker is waiting on wakeup, modified atomically under
+     * the pool mutex. */
+    bool parked;
+
+} __attribute__ ((aligned (CACHE_LINE_SIZE)));
+
+/* Autoscaling state, accessed only by the submitting thread. */
+struct autoscale {
+    bool enabled;
+    unsigned min_workers;
+    unsigned max_workers;
+
+    /* The time of the last check and the total time the submitter waited
+     * for the workers at this time. */
+    uint64_t last_check;
+    uint64_t last_wait_usec;
+};
+
+/*
+ * The pool may be used by one or more hashes. Submissions carry the
+ * configuration of their hash, so the pool does not depend on the hash
+ * configuration.
+ */
 struct hash_pool {
-    pthread_cond_t not_empty;
-    pthread_cond_t not_full;
-    pthread_mutex_t mutex;
-    pthread_t *workers;
-    struct submission **queue;
-    const struct config *config;
+    struct worker *workers;
 
-    unsigned int queue_size;
+    /* Used only for parking and waking up idle workers, and for submitters
+     * waiting for space in the queues. */
+    pthread_mutex_t mutex;
 
-    /* XXX replace with computed length:
-     * (size + tail - head) % size
-     * assuming empty slot (size - 1 items)
-     */
-    unsigned int queue_len;
+    /* Signaled when a worker takes a submission while submitters wait. */
+    pthread_cond_t space;
 
-    unsigned int queue_head;
-    unsigned int queue_tail;
+    /* Number of submitters waiting on space, modified atomically under the
+     * mutex. */
+    unsigned int submitters_waiting;
 
     unsigned int workers_count;
+
+    /* Number of workers receiving submissions, modified atomically. Other
+     * workers do not steal work, and park when their queue is empty. */
+    unsigned int workers_active;
+
+    /* Number of parked workers, modified atomically. */
     unsigned int workers_idle;
 
-    int error;
+    /* The worker for the next submission, modified atomically since a
+     * shared pool has multiple submitters. */
+    unsigned int next_worker;
+
+    /* Set when stopping the workers, modified atomically. */
+    bool stopping;
+
+    /* Set before stopping the workers. */
     bool stopped;
 
+    struct autoscale autoscale;
+
 } __attribute__ ((aligned (CACHE_LINE_SIZE)));
 
-int hash_pool_init(struct hash_pool *p, const struct config *config);
+/*
+ * Start workers threads, each with a queue of queue_size submissions. If the
+ * pool is used by a single hash, queue_size should be the maximum number of
+ * submissions of the hash, so submitting never waits for a queue. If cpus is
+ * not NULL or empty, workers run only on these CPUs.
+ */
+int hash_pool_init(struct hash_pool *p, unsigned workers, unsigned queue_size,
+                   const struct cpu_mask *cpus);
 
 int hash_pool_submit(struct hash_pool *p, struct submission *sub);
 
+/*
+ * Submit count submissions, waking up workers once for the entire batch.
+ * Submissions that cannot be queued are completed with an error. If all
+ * queues are full, sleep until a worker takes a submission. This is possible
+ * only with a shared pool; every hash can have at most max_submissions
+ * submissions in the queues, so waiting is bounded by the other hashes.
+ */
+int hash_pool_submit_batch(struct hash_pool *p, struct submission **subs,
+                           unsigned count);
+
+/*
+ * Start with min_workers active workers, and grow or shrink the active
+ * workers up to the number of pool workers in hash_pool_autoscale(). Can be
+ * used only by a pool with a single submitter.
+ */
+void hash_pool_enable_autoscale(struct hash_pool *p, unsigned min_workers);
+
+/*
+ * Called by the submitter after submitting, with the total time it waited
+ * for the workers. If autoscaling is enabled, add workers when the caller
+ * waits for the workers or the active workers have a backlog, and remove
+ * workers when active workers are parked.
+ */
+void hash_pool_autoscale(struct hash_pool *p, uint64_t wait_usec);
+
 int hash_pool_destroy(struct hash_pool *p);
 
 #endif /* HASH_POOL_H */
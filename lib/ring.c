@@ -0,0 +1,38 @@
+// SPDX-FileCopyrightText: Red Hat Inc
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+
+int ring_init(struct ring *r, unsigned size)
+{
+    uint64_t capacity = 1;
+
+    while (capacity < size)
+        capacity <<= 1;
+
+    r->slots = malloc(capacity * sizeof(*r->slots));
+    if (r->slots == NULL)
+        return errno;
+
+    /* Slot i is ready for the producer at position i. */
+    for (uint64_t i = 0; i < capacity; i++) {
+        r->slots[i].seq = i;
+        r->slots[i].value = NULL;
+    }
+
+    r->mask = capacity - 1;
+    r->head = 0;
+    r->tail = 0;
+
+    return 0;
+}
+
+void ring_destroy(struct ring *r)
+{
+    free(r->slots);
+    memset(r, 0, sizeof(*r));
+}
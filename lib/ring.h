@@ -0,0 +1,133 @@
+// SPDX-FileCopyrightText: Red Hat Inc
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#ifndef RING_H
+#define RING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "blkhash-config.h"
+
+/*
+ * Bounded lock-free multi-producer multi-consumer ring of pointers.
+ *
+ * Based on Dmitry Vyukov's bounded MPMC queue. Every slot keeps a sequence
+ * number telling if the slot is ready for the producer or the consumer at the
+ * current position, so producers and consumers synchronize only on the slot
+ * they use and on the head or tail position.
+ *
+ * See https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+ */
+
+struct ring_slot {
+    uint64_t seq;
+    void *value;
+};
+
+struct ring {
+    /* Modified only by consumers. */
+    uint64_t head __attribute__ ((aligned (CACHE_LINE_SIZE)));
+
+    /* Modified only by producers. */
+    uint64_t tail __attribute__ ((aligned (CACHE_LINE_SIZE)));
+
+    /* Read only after ring_init(). */
+    struct ring_slot *slots __attribute__ ((aligned (CACHE_LINE_SIZE)));
+    uint64_t mask;
+} __attribute__ ((aligned (CACHE_LINE_SIZE)));
+
+/*
+ * Initialize a ring holding at least size items. The actual size is rounded
+ * up to a power of 2. Return 0 on success and errno value on errors.
+ */
+int ring_init(struct ring *r, unsigned size);
+
+/*
+ * Push value to the tail of the ring. Return false if the ring is full.
+ */
+static inline bool ring_push(struct ring *r, void *value)
+{
+    struct ring_slot *slot;
+    uint64_t pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+
+    for (;;) {
+        slot = &r->slots[pos & r->mask];
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)(seq - pos);
+
+        if (diff == 0) {
+            /* The slot is free, try to take it. On failure pos is updated to
+             * the current tail. */
+            if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            /* The slot was not consumed yet since the last round. */
+            return false;
+        } else {
+            /* Another producer took this slot. */
+            pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->value = value;
+
+    /* Publish the value to consumers. */
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+/*
+ * Pop a value from the head of the ring. Return NULL if the ring is empty.
+ */
+static inline void *ring_pop(struct ring *r)
+{
+    struct ring_slot *slot;
+    void *value;
+    uint64_t pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+
+    for (;;) {
+        slot = &r->slots[pos & r->mask];
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)(seq - (pos + 1));
+
+        if (diff == 0) {
+            /* The slot has a value, try to take it. On failure pos is updated
+             * to the current head. */
+            if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            /* The slot was not published yet. */
+            return NULL;
+        } else {
+            /* Another consumer took this slot. */
+            pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    value = slot->value;
+
+    /* Release the slot to producers in the next round. */
+    __atomic_store_n(&slot->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+
+    return value;
+}
+
+/*
+ * Return the number of items in the ring. The value is exact only when there
+ * are no concurrent producers and consumers, but good enough for heuristics.
+ */
+static inline unsigned ring_len(struct ring *r)
+{
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+
+    return tail > head ? tail - head : 0;
+}
+
+void ring_destroy(struct ring *r);
+
+#endif /* RING_H */
@@ -0,0 +1,257 @@
+// SPDX-FileCopyrightText: Red Hat Inc
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include <stdint.h>
+#include <string.h>
+
+#include "sha256-mb.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define AVX2 __attribute__ ((target ("avx2")))
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const uint32_t H0[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+#define ROTR(x, n) \
+    _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+
+#define XOR3(a, b, c) _mm256_xor_si256(_mm256_xor_si256(a, b), c)
+
+#define ADD(a, b) _mm256_add_epi32(a, b)
+
+/* Transpose 8x8 matrix of 32 bit words, converting 8 rows of message words
+ * to 8 vectors of the same word in all lanes. */
+static inline AVX2 void transpose(__m256i r[8])
+{
+    __m256i t[8], u[8];
+
+    for (int i = 0; i < 8; i += 2) {
+        t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+        t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+    }
+
+    for (int i = 0; i < 8; i += 4) {
+        u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+        u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+        u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+        u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+    }
+
+    for (int i = 0; i < 4; i++) {
+        r[i] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+        r[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+    }
+}
+
+/* Process one 64 bytes block from every lane. */
+static AVX2 void compress(__m256i state[8], const unsigned char *blocks[8])
+{
+    const __m256i bswap = _mm256_setr_epi8(
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    __m256i w[16];
+    __m256i a = state[0], b = state[1], c = state[2], d = state[3];
+    __m256i e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for (int half = 0; half < 2; half++) {
+        __m256i *r = &w[half * 8];
+
+        for (int i = 0; i < 8; i++)
+            r[i] = _mm256_loadu_si256((const __m256i *)(blocks[i] + half * 32));
+
+        transpose(r);
+
+        for (int i = 0; i < 8; i++)
+            r[i] = _mm256_shuffle_epi8(r[i], bswap);
+    }
+
+    for (int t = 0; t < 64; t++) {
+        __m256i wt, t1, t2;
+
+        if (t < 16) {
+            wt = w[t];
+        } else {
+            __m256i w2 = w[(t - 2) & 15];
+            __m256i w15 = w[(t - 15) & 15];
+            __m256i s0 = XOR3(ROTR(w15, 7), ROTR(w15, 18),
+                              _mm256_srli_epi32(w15, 3));
+            __m256i s1 = XOR3(ROTR(w2, 17), ROTR(w2, 19),
+                              _mm256_srli_epi32(w2, 10));
+            wt = ADD(ADD(s1, w[(t - 7) & 15]), ADD(s0, w[t & 15]));
+            w[t & 15] = wt;
+        }
+
+        __m256i S1 = XOR3(ROTR(e, 6), ROTR(e, 11), ROTR(e, 25));
+        __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f),
+                                      _mm256_andnot_si256(e, g));
+        t1 = ADD(ADD(ADD(h, S1), ADD(ch, _mm256_set1_epi32(K[t]))), wt);
+
+        __m256i S0 = XOR3(ROTR(a, 2), ROTR(a, 13), ROTR(a, 22));
+        __m256i maj = _mm256_or_si256(_mm256_and_si256(a, b),
+                                      _mm256_and_si256(c, _mm256_or_si256(a, b)));
+        t2 = ADD(S0, maj);
+
+        h = g;
+        g = f;
+        f = e;
+        e = ADD(d, t1);
+        d = c;
+        c = b;
+        b = a;
+        a = ADD(t1, t2);
+    }
+
+    state[0] = ADD(state[0], a);
+    state[1] = ADD(state[1], b);
+    state[2] = ADD(state[2], c);
+    state[3] = ADD(state[3], d);
+    state[4] = ADD(state[4], e);
+    state[5] = ADD(state[5], f);
+    state[6] = ADD(state[6], g);
+    state[7] = ADD(state[7], h);
+}
+
+/* Hash up to 8 messages. Unused lanes hash the first message again. */
+static AVX2 void sha256_mb_avx2(const void **data, size_t len, unsigned count,
+                                unsigned char **md)
+{
+    unsigned char tail[SHA256_MB_LANES][128];
+    const unsigned char *blocks[SHA256_MB_LANES];
+    uint32_t words[8][SHA256_MB_LANES];
+    __m256i state[8];
+    size_t full = len / 64;
+    size_t rest = len % 64;
+    size_t tail_len = rest < 56 ? 64 : 128;
+    uint64_t bits = (uint64_t)len * 8;
+
+    for (int i = 0; i < 8; i++)
+        state[i] = _mm256_set1_epi32(H0[i]);
+
+    for (size_t n = 0; n < full; n++) {
+        for (unsigned i = 0; i < SHA256_MB_LANES; i++) {
+            const unsigned char *p = i < count ? data[i] : data[0];
+            blocks[i] = p + n * 64;
+        }
+        compress(state, blocks);
+    }
+
+    /* The last partial block, padding and message length. */
+    for (unsigned i = 0; i < SHA256_MB_LANES; i++) {
+        const unsigned char *p = i < count ? data[i] : data[0];
+
+        memcpy(tail[i], p + full * 64, rest);
+        tail[i][rest] = 0x80;
+        memset(tail[i] + rest + 1, 0, tail_len - rest - 1 - 8);
+        for (int b = 0; b < 8; b++)
+            tail[i][tail_len - 1 - b] = bits >> (b * 8);
+    }
+
+    for (size_t off = 0; off < tail_len; off += 64) {
+        for (unsigned i = 0; i < SHA256_MB_LANES; i++)
+            blocks[i] = tail[i] + off;
+        compress(state, blocks);
+    }
+
+    for (int i = 0; i < 8; i++)
+        _mm256_storeu_si256((__m256i *)words[i], state[i]);
+
+    for (unsigned i = 0; i < count; i++) {
+        for (int j = 0; j < 8; j++) {
+            uint32_t v = words[j][i];
+            md[i][j * 4] = v >> 24;
+            md[i][j * 4 + 1] = v >> 16;
+            md[i][j * 4 + 2] = v >> 8;
+            md[i][j * 4 + 3] = v;
+        }
+    }
+}
+
+static bool cpu_has_sha(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        return false;
+
+    return ebx & (1 << 29);
+}
+
+bool sha256_mb_available(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+bool sha256_mb_supported(void)
+{
+    static int supported = -1;
+    int value = __atomic_load_n(&supported, __ATOMIC_RELAXED);
+
+    if (value == -1) {
+        value = sha256_mb_available() && !cpu_has_sha();
+        __atomic_store_n(&supported, value, __ATOMIC_RELAXED);
+    }
+
+    return value;
+}
+
+void sha256_mb(const void **data, size_t len, unsigned count,
+               unsigned char **md)
+{
+    while (count > 0) {
+        unsigned n = count < SHA256_MB_LANES ? count : SHA256_MB_LANES;
+
+        sha256_mb_avx2(data, len, n, md);
+
+        data += n;
+        md += n;
+        count -= n;
+    }
+}
+
+#else
+
+bool sha256_mb_available(void)
+{
+    return false;
+}
+
+bool sha256_mb_supported(void)
+{
+    return false;
+}
+
+void sha256_mb(const void **data, size_t len, unsigned count,
+               unsigned char **md)
+{
+    (void)data;
+    (void)len;
+    (void)count;
+    (void)md;
+}
+
+#endif
@@ -0,0 +1,39 @@
+// SPDX-FileCopyrightText: Red Hat Inc
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#ifndef SHA256_MB_H
+#define SHA256_MB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Multi-buffer SHA-256, computing the digests of several independent messages
+ * of the same length at once, one message per SIMD lane.
+ */
+
+#define SHA256_MB_LANES 8
+#define SHA256_MB_DIGEST_LEN 32
+
+/*
+ * Return true if multi-buffer SHA-256 is supported and faster than single
+ * buffer SHA-256 on this CPU. Multi-buffer hashing requires AVX2, but CPUs
+ * with SHA extensions are faster using single buffer SHA-256.
+ */
+bool sha256_mb_supported(void);
+
+/*
+ * Return true if the multi-buffer implementation can run on this CPU, even
+ * if single buffer SHA-256 is faster.
+ */
+bool sha256_mb_available(void);
+
+/*
+ * Compute SHA-256 digest of count messages of len bytes, storing the digest
+ * of message data[i] in md[i]. Must be called only if sha256_mb_available()
+ * returns true.
+ */
+void sha256_mb(const void **data, size_t len, unsigned count,
+               unsigned char **md);
+
+#endif /* SHA256_MB_H */
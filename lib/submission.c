@@ -1,35 +1,184 @@
 // SPDX-FileCopyrightText: Red Hat Inc
 // SPDX-License-Identifier: LGPL-2.1-or-later
 
+#include <sched.h>
 #include <stdint.h>
 #include <stdlib.h>
 
 #include "submission.h"
 
+/* Number of busy checks before using CPU relax hints. */
+#define SPIN_COUNT 64
+
+/* Number of checks using CPU relax hints before sleeping. */
+#define RELAX_COUNT 1024
+
+int submission_arena_init(struct submission_arena *a,
+                          const struct config *config)
+{
+    unsigned size = config->max_submissions;
+    int err;
+
+    /* Align to avoid false sharing between workers. */
+    err = posix_memalign((void **)&a->array, CACHE_LINE_SIZE,
+                         size * sizeof(*a->array));
+    if (err)
+        return err;
+
+    a->free = malloc(size * sizeof(*a->free));
+    if (a->free == NULL) {
+        err = errno;
+        goto fail_free;
+    }
+
+    err = pthread_mutex_init(&a->mutex, NULL);
+    if (err)
+        goto fail_mutex;
+
+    err = pthread_cond_init(&a->completed, NULL);
+    if (err)
+        goto fail_cond;
+
+    a->buffer_size = config->block_size;
+    a->size = size;
+    a->free_count = size;
+    a->completing = 0;
+
+    /* The free list is a stack; push in reverse so the first submission is
+     * used first. */
+    for (unsigned i = 0; i < size; i++) {
+        struct submission *sub = &a->array[i];
+
+        sub->arena = a;
+        sub->config = config;
+        sub->buffer = NULL;
+        sub->waiting = false;
+        a->free[size - 1 - i] = sub;
+    }
+
+    memset(&a->stats, 0, sizeof(a->stats));
+
+    return 0;
+
+fail_cond:
+    pthread_mutex_destroy(&a->mutex);
+fail_mutex:
+    free(a->free);
+    a->free = NULL;
+fail_free:
+    free(a->array);
+    a->array = NULL;
+
+    return err;
+}
+
+void submission_arena_destroy(struct submission_arena *a)
+{
+    if (a->array) {
+        for (unsigned i = 0; i < a->size; i++)
+            free(a->array[i].buffer);
+
+        cond_destroy(&a->completed);
+        mutex_destroy(&a->mutex);
+    }
+
+    free(a->array);
+    free(a->free);
+    memset(a, 0, sizeof(*a));
+}
+
+void submission_arena_quiesce(struct submission_arena *a)
+{
+    unsigned i = 0;
+
+    /* The window is short, but the worker may be preempted inside it. */
+    while (__atomic_load_n(&a->completing, __ATOMIC_ACQUIRE)) {
+        if (++i < RELAX_COUNT)
+            cpu_relax();
+        else
+            sched_yield();
+    }
+}
+
+static int take_submission(struct submission_arena *a, struct submission **out)
+{
+    /* Cannot happen since live submissions are bounded by the submission
+     * queue size. */
+    if (a->free_count == 0)
+        return ENOBUFS;
+
+    *out = a->free[--a->free_count];
+    return 0;
+}
+
+static int allocate_buffer(struct submission *sub)
+{
+    if (sub->buffer == NULL) {
+        sub->buffer = malloc(sub->arena->buffer_size);
+        if (sub->buffer == NULL)
+            return errno;
+    }
+
+    return 0;
+}
+
+static void *place_buffers(void *arg)
+{
+    struct submission_arena *a = arg;
+    int err;
+
+    for (unsigned i = 0; i < a->size; i++) {
+        struct submission *sub = &a->array[i];
+
+        err = allocate_buffer(sub);
+        if (err)
+            return (void *)(intptr_t)err;
+
+        /* Pages are placed when touched first. */
+        memset(sub->buffer, 0, a->buffer_size);
+    }
+
+    return NULL;
+}
+
+int submission_arena_place_buffers(struct submission_arena *a,
+                                   const struct cpu_mask *cpus)
+{
+    void *ret;
+    int err;
+
+    err = cpu_mask_run(cpus, place_buffers, a, &ret);
+    if (err)
+        return err;
+
+    return (int)(intptr_t)ret;
+}
+
 static int copy_data(struct submission *sub)
 {
-    void *data;
+    int err;
 
-    data = malloc(sub->len);
-    if (data == NULL)
-        return errno;
+    err = allocate_buffer(sub);
+    if (err)
+        return err;
 
-    memcpy(data, sub->data, sub->len);
-    sub->data = data;
+    memcpy(sub->buffer, sub->data, sub->len);
+    sub->data = sub->buffer;
 
     return 0;
 }
 
-int submission_create_data(int64_t index, uint32_t len, const void *data,
+int submission_create_data(struct submission_arena *a, int64_t index,
+                           uint32_t len, const void *data,
                            struct completion *completion, uint8_t flags,
                            struct submission **out)
 {
     struct submission *sub;
     int err;
 
-    sub = malloc(sizeof(*sub));
-    if (sub == NULL)
-        return errno;
+    err = take_submission(a, &sub);
+    if (err)
+        return err;
 
     sub->completion = completion;
     sub->data = data;
@@ -53,17 +202,61 @@ int submission_create_data(int64_t index, uint32_t len, const void *data,
     return 0;
 
 error:
-    free(sub);
+    submission_destroy(sub);
     return err;
 }
 
-int submission_create_zero(int64_t index, struct submission **out)
+int submission_create_copy(struct submission_arena *a, int64_t index,
+                           uint32_t len, const void *data,
+                           struct completion *completion,
+                           struct submission **out)
 {
     struct submission *sub;
+    int err;
 
-    sub = malloc(sizeof(*sub));
-    if (sub == NULL)
-        return errno;
+    err = take_submission(a, &sub);
+    if (err)
+        return err;
+
+    err = allocate_buffer(sub);
+    if (err)
+        goto error;
+
+    if (copy_unless_zero(sub->buffer, data, len)) {
+        submission_destroy(sub);
+        *out = NULL;
+        return 0;
+    }
+
+    sub->completion = completion;
+    sub->data = sub->buffer;
+    sub->index = index;
+    sub->len = len;
+    sub->error = 0;
+    sub->zero = false;
+    sub->completed = false;
+    sub->flags = SUBMIT_COPY_DATA;
+
+    if (sub->completion)
+        completion_ref(sub->completion);
+
+    *out = sub;
+    return 0;
+
+error:
+    submission_destroy(sub);
+    return err;
+}
+
+int submission_create_zero(struct submission_arena *a, int64_t index,
+                           struct submission **out)
+{
+    struct submission *sub;
+    int err;
+
+    err = take_submission(a, &sub);
+    if (err)
+        return err;
 
     sub->completion = NULL;
     sub->data = NULL;
@@ -78,15 +271,95 @@ int submission_create_zero(int64_t index, struct submission **out)
     return 0;
 }
 
+int submission_create_digest(struct submission_arena *a, int64_t index,
+                             const unsigned char *const *md,
+                             struct submission **out)
+{
+    struct submission *sub;
+    int err;
+
+    err = take_submission(a, &sub);
+    if (err)
+        return err;
+
+    for (unsigned i = 0; i < sub->config->digests_count; i++)
+        memcpy(sub->md[i], md[i], sub->config->digests[i].md_len);
+
+    sub->completion = NULL;
+    sub->data = NULL;
+    sub->index = index;
+    sub->len = 0;
+    sub->error = 0;
+    sub->zero = false;
+    sub->completed = true;
+    sub->flags = 0;
+
+    *out = sub;
+    return 0;
+}
+
+static bool submission_spin(struct submission *sub)
+{
+    for (unsigned i = 0; i < SPIN_COUNT; i++) {
+        if (submission_is_completed(sub))
+            return true;
+    }
+
+    for (unsigned i = 0; i < RELAX_COUNT; i++) {
+        cpu_relax();
+        if (submission_is_completed(sub))
+            return true;
+    }
+
+    return false;
+}
+
+static void submission_sleep(struct submission *sub)
+{
+    struct submission_arena *a = sub->arena;
+
+    mutex_lock(&a->mutex);
+
+    __atomic_store_n(&sub->waiting, true, __ATOMIC_RELAXED);
+
+    /* Pairs with the fence in submission_complete(). */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    while (!submission_is_completed(sub))
+        cond_wait(&a->completed, &a->mutex);
+
+    __atomic_store_n(&sub->waiting, false, __ATOMIC_RELAXED);
+
+    mutex_unlock(&a->mutex);
+}
+
+void submission_wait_slow(struct submission *sub)
+{
+    struct wait_stats *stats = &sub->arena->stats;
+    uint64_t start = now_usec();
+
+    if (submission_spin(sub)) {
+        stats->spins++;
+        stats->spin_usec += now_usec() - start;
+        return;
+    }
+
+    submission_sleep(sub);
+
+    stats->sleeps++;
+    stats->sleep_usec += now_usec() - start;
+}
+
 void submission_destroy(struct submission *sub)
 {
+    struct submission_arena *a;
+
     if (sub == NULL)
         return;
 
-    if (sub->data && sub->flags & SUBMIT_COPY_DATA)
-        free((void *)sub->data);
-
-    free(sub);
+    /* Return the submission to the arena, keeping the buffer. */
+    a = sub->arena;
+    a->free[a->free_count++] = sub;
 }
 
 int submission_queue_init(struct submission_queue *sq, unsigned size)
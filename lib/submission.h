@@ -10,6 +10,7 @@
 
 #include "blkhash-config.h"
 #include "blkhash-internal.h"
+#include "threads.h"
 
 /*
  * Copy data from user buffer into the submission. When not set
@@ -20,8 +21,21 @@
  */
 #define SUBMIT_COPY_DATA 0x1
 
+struct submission_arena;
+
 struct submission {
-    unsigned char md[BLKHASH_MAX_MD_SIZE];
+    /* Block digest for every digest of the hash. */
+    unsigned char md[BLKHASH_MAX_DIGESTS][BLKHASH_MAX_MD_SIZE];
+
+    /* The arena owning this submission. */
+    struct submission_arena *arena;
+
+    /* The configuration of the hash owning this submission. */
+    const struct config *config;
+
+    /* Buffer for copying data, owned by the submission. Allocated on the
+     * first use and kept when the submission is reused. */
+    void *buffer;
 
     /* Completion for DATA submission, used to wait until all submissions are
      * handled by the workers. */
@@ -43,11 +57,38 @@ struct submission {
     /* Processing was completed. */
     bool completed;
 
+    /* The caller is sleeping in submission_wait(), modified atomically. */
+    bool waiting;
+
     uint8_t flags;
 
     /* Align to avoid false sharing between workers. */
 } __attribute__ ((aligned (CACHE_LINE_SIZE)));
 
+/*
+ * Preallocated submissions. The number of live submissions is bounded by the
+ * submission queue size, so submissions are taken from the arena and
+ * returned to it instead of allocating memory for every block. Accessed only
+ * by the caller thread, except the mutex and condition used to wake up the
+ * caller waiting for a submission.
+ */
+struct submission_arena {
+    struct submission *array;
+    struct submission **free;
+    uint32_t buffer_size;
+    unsigned size;
+    unsigned free_count;
+
+    /* For sleeping in submission_wait() */
+    pthread_mutex_t mutex;
+    pthread_cond_t completed;
+
+    struct wait_stats stats;
+
+    /* Number of workers in submission_complete(), modified atomically. */
+    unsigned completing __attribute__ ((aligned (CACHE_LINE_SIZE)));
+};
+
 struct submission_queue {
     struct submission **ring;
     unsigned size;
@@ -56,11 +97,53 @@ struct submission_queue {
     unsigned tail;
 };
 
-int submission_create_data(int64_t index, uint32_t len, const void *data,
+/*
+ * Initialize an arena with config->max_submissions submissions, each using a
+ * buffer of config->block_size bytes.
+ */
+int submission_arena_init(struct submission_arena *a,
+                          const struct config *config);
+
+/*
+ * Allocate the copy buffers of all submissions on a thread running on cpus,
+ * so the buffers are placed on the NUMA node of the workers.
+ */
+int submission_arena_place_buffers(struct submission_arena *a,
+                                   const struct cpu_mask *cpus);
+
+/*
+ * Wait until no worker is completing a submission from this arena. Workers
+ * access the arena after a submission was completed, so this must be called
+ * after all submissions were completed before destroying the arena.
+ */
+void submission_arena_quiesce(struct submission_arena *a);
+
+void submission_arena_destroy(struct submission_arena *a);
+
+int submission_create_data(struct submission_arena *a, int64_t index,
+                           uint32_t len, const void *data,
                            struct completion *completion, uint8_t flags,
                            struct submission **out);
 
-int submission_create_zero(int64_t index, struct submission **out);
+/*
+ * Create a data submission copying len bytes from data, detecting zeros while
+ * copying. If data is zero, no submission is created and *out is set to NULL.
+ */
+int submission_create_copy(struct submission_arena *a, int64_t index,
+                           uint32_t len, const void *data,
+                           struct completion *completion,
+                           struct submission **out);
+
+int submission_create_zero(struct submission_arena *a, int64_t index,
+                           struct submission **out);
+
+/*
+ * Create a completed submission for a data block using block digests computed
+ * before, one for every digest of the hash.
+ */
+int submission_create_digest(struct submission_arena *a, int64_t index,
+                             const unsigned char *const *md,
+                             struct submission **out);
 
 static inline void submission_set_zero(struct submission *sub)
 {
@@ -87,11 +170,16 @@ static inline int submission_error(const struct submission *sub)
 
 static inline void submission_complete(struct submission *sub)
 {
+    struct submission_arena *a = sub->arena;
+
     if (sub->completion) {
         completion_unref(sub->completion);
         sub->completion = NULL;
     }
 
+    /* Ordered before completed by the release store below. */
+    __atomic_add_fetch(&a->completing, 1, __ATOMIC_RELAXED);
+
     /*
      * Synchronize with the fence in submission_is_completed().  No reads or
      * writes in the current thread can be reordered after this store.
@@ -99,6 +187,22 @@ static inline void submission_complete(struct submission *sub)
      * See https://en.cppreference.com/w/c/atomic/memory_order#Constants
      */
     __atomic_store_n(&sub->completed, true, __ATOMIC_RELEASE);
+
+    /*
+     * Pairs with the fence in submission_sleep(); either the caller sees
+     * that the submission was completed, or we see that the caller is
+     * sleeping and wake it up.
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&sub->waiting, __ATOMIC_RELAXED)) {
+        mutex_lock(&a->mutex);
+        cond_broadcast(&a->completed);
+        mutex_unlock(&a->mutex);
+    }
+
+    /* The last access to the arena; pairs with submission_arena_quiesce(). */
+    __atomic_sub_fetch(&a->completing, 1, __ATOMIC_RELEASE);
 }
 
 static inline bool submission_is_completed(const struct submission *sub)
@@ -118,10 +222,18 @@ static inline bool submission_is_completed(const struct submission *sub)
     return completed;
 }
 
-static inline void submission_wait(const struct submission *sub)
+/* Slow path for submission_wait(). */
+void submission_wait_slow(struct submission *sub);
+
+/*
+ * Wait until the submission is completed. Spin briefly, since the submission
+ * is likely to complete soon, and then sleep until the worker completing the
+ * submission wakes us up.
+ */
+static inline void submission_wait(struct submission *sub)
 {
-    while (!submission_is_completed(sub))
-        ;
+    if (!submission_is_completed(sub))
+        submission_wait_slow(sub);
 }
 
 void submission_destroy(struct submission *sub);
@@ -4,9 +4,34 @@
 #ifndef THREADS_H
 #define THREADS_H
 
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
+
 #include "blkhash-internal.h"
 
+/* Hint the CPU that we are spinning, reducing power and leaving resources to
+ * the sibling hyper thread. */
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield" ::: "memory");
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+/* Monotonic time in microseconds, for measuring waits. */
+static inline uint64_t now_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 static inline void mutex_lock(pthread_mutex_t *m)
 {
     int err = pthread_mutex_lock(m);
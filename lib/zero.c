@@ -5,12 +5,21 @@
 #include <string.h>
 
 #include "blkhash-internal.h"
+#include "util.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
 
 /*
  * Based on Rusty Russell's memeqzero.
  * See http://rusty.ozlabs.org/?p=560 for more info.
  */
-bool is_zero(const void *buf, size_t len)
+static bool is_zero_generic(const void *buf, size_t len)
 {
     uint64_t n[2];
 
@@ -28,3 +37,255 @@ bool is_zero(const void *buf, size_t len)
     /* Now we know that's zero, memcmp with self. */
     return memcmp(buf, buf + 16, len - 16) == 0;
 }
+
+/*
+ * The vectorized variants check the first vector, for quick exit on data
+ * blocks, and then check 4 vectors per iteration. The last iteration may
+ * overlap the previous one. Short buffers use the generic variant.
+ */
+
+#ifdef HAVE_X86
+
+#define SSE2 __attribute__ ((target ("sse2")))
+#define AVX2 __attribute__ ((target ("avx2")))
+#define AVX512 __attribute__ ((target ("avx512f")))
+
+static inline SSE2 bool sse2_is_zero(__m128i v)
+{
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) == 0xffff;
+}
+
+static inline SSE2 __m128i sse2_or4(const unsigned char *p)
+{
+    return _mm_or_si128(
+        _mm_or_si128(_mm_loadu_si128((const __m128i *)p),
+                     _mm_loadu_si128((const __m128i *)(p + 16))),
+        _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + 32)),
+                     _mm_loadu_si128((const __m128i *)(p + 48))));
+}
+
+static SSE2 bool is_zero_sse2(const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    const unsigned char *end = p + len;
+
+    if (len < 64)
+        return is_zero_generic(buf, len);
+
+    if (!sse2_is_zero(_mm_loadu_si128((const __m128i *)p)))
+        return false;
+
+    for (; p + 64 <= end; p += 64) {
+        if (!sse2_is_zero(sse2_or4(p)))
+            return false;
+    }
+
+    if (p < end)
+        return sse2_is_zero(sse2_or4(end - 64));
+
+    return true;
+}
+
+static inline AVX2 bool avx2_is_zero(__m256i v)
+{
+    return _mm256_testz_si256(v, v);
+}
+
+static inline AVX2 __m256i avx2_or4(const unsigned char *p)
+{
+    return _mm256_or_si256(
+        _mm256_or_si256(_mm256_loadu_si256((const __m256i *)p),
+                        _mm256_loadu_si256((const __m256i *)(p + 32))),
+        _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(p + 64)),
+                        _mm256_loadu_si256((const __m256i *)(p + 96))));
+}
+
+static AVX2 bool is_zero_avx2(const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    const unsigned char *end = p + len;
+
+    if (len < 128)
+        return is_zero_generic(buf, len);
+
+    if (!avx2_is_zero(_mm256_loadu_si256((const __m256i *)p)))
+        return false;
+
+    for (; p + 128 <= end; p += 128) {
+        if (!avx2_is_zero(avx2_or4(p)))
+            return false;
+    }
+
+    if (p < end)
+        return avx2_is_zero(avx2_or4(end - 128));
+
+    return true;
+}
+
+static inline AVX512 bool avx512_is_zero(__m512i v)
+{
+    return _mm512_test_epi64_mask(v, v) == 0;
+}
+
+static inline AVX512 __m512i avx512_or4(const unsigned char *p)
+{
+    return _mm512_or_si512(
+        _mm512_or_si512(_mm512_loadu_si512(p),
+                        _mm512_loadu_si512(p + 64)),
+        _mm512_or_si512(_mm512_loadu_si512(p + 128),
+                        _mm512_loadu_si512(p + 192)));
+}
+
+static AVX512 bool is_zero_avx512(const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    const unsigned char *end = p + len;
+
+    if (len < 256)
+        return is_zero_generic(buf, len);
+
+    if (!avx512_is_zero(_mm512_loadu_si512(p)))
+        return false;
+
+    for (; p + 256 <= end; p += 256) {
+        if (!avx512_is_zero(avx512_or4(p)))
+            return false;
+    }
+
+    if (p < end)
+        return avx512_is_zero(avx512_or4(end - 256));
+
+    return true;
+}
+
+static bool have_sse2(void) { return __builtin_cpu_supports("sse2"); }
+static bool have_avx2(void) { return __builtin_cpu_supports("avx2"); }
+static bool have_avx512(void) { return __builtin_cpu_supports("avx512f"); }
+
+#endif /* HAVE_X86 */
+
+#ifdef HAVE_NEON
+
+static inline bool neon_is_zero(uint8x16_t v)
+{
+    return vmaxvq_u32(vreinterpretq_u32_u8(v)) == 0;
+}
+
+static inline uint8x16_t neon_or4(const unsigned char *p)
+{
+    return vorrq_u8(vorrq_u8(vld1q_u8(p), vld1q_u8(p + 16)),
+                    vorrq_u8(vld1q_u8(p + 32), vld1q_u8(p + 48)));
+}
+
+static bool is_zero_neon(const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    const unsigned char *end = p + len;
+
+    if (len < 64)
+        return is_zero_generic(buf, len);
+
+    if (!neon_is_zero(vld1q_u8(p)))
+        return false;
+
+    for (; p + 64 <= end; p += 64) {
+        if (!neon_is_zero(neon_or4(p)))
+            return false;
+    }
+
+    if (p < end)
+        return neon_is_zero(neon_or4(end - 64));
+
+    return true;
+}
+
+/* NEON is mandatory on aarch64. */
+static bool have_neon(void) { return true; }
+
+#endif /* HAVE_NEON */
+
+static bool have_generic(void) { return true; }
+
+/* Ordered from slowest to fastest. */
+static const struct {
+    struct zero_variant variant;
+    bool (*supported)(void);
+} all_variants[] = {
+    {{"generic", is_zero_generic}, have_generic},
+#ifdef HAVE_X86
+    {{"sse2", is_zero_sse2}, have_sse2},
+    {{"avx2", is_zero_avx2}, have_avx2},
+    {{"avx512", is_zero_avx512}, have_avx512},
+#endif
+#ifdef HAVE_NEON
+    {{"neon", is_zero_neon}, have_neon},
+#endif
+};
+
+static struct zero_variant variants[ARRAY_SIZE(all_variants)];
+static unsigned variants_count;
+
+static bool (*is_zero_best)(const void *buf, size_t len) = is_zero_generic;
+
+/* Select the fastest variant once when the library is loaded. */
+__attribute__ ((constructor))
+static void init_variants(void)
+{
+#ifdef HAVE_X86
+    __builtin_cpu_init();
+#endif
+
+    for (unsigned i = 0; i < ARRAY_SIZE(all_variants); i++) {
+        if (all_variants[i].supported())
+            variants[variants_count++] = all_variants[i].variant;
+    }
+
+    is_zero_best = variants[variants_count - 1].is_zero;
+}
+
+unsigned zero_variants(const struct zero_variant **out)
+{
+    *out = variants;
+    return variants_count;
+}
+
+bool is_zero(const void *buf, size_t len)
+{
+    return is_zero_best(buf, len);
+}
+
+/* Small enough to keep the chunk in L1 cache until we copy it. */
+#define COPY_CHUNK_SIZE (1 * KiB)
+
+bool copy_unless_zero(void *dst, const void *src, size_t len)
+{
+    size_t offset = 0;
+
+    if (len < COPY_CHUNK_SIZE) {
+        if (is_zero_best(src, len))
+            return true;
+        goto copy;
+    }
+
+    /* Find the first chunk with data without writing anything. */
+    for (; offset + COPY_CHUNK_SIZE <= len; offset += COPY_CHUNK_SIZE) {
+        if (!is_zero_best(src + offset, COPY_CHUNK_SIZE))
+            goto copy;
+    }
+
+    if (offset < len && !is_zero_best(src + len - COPY_CHUNK_SIZE,
+                                      COPY_CHUNK_SIZE)) {
+        offset = len - COPY_CHUNK_SIZE;
+        goto copy;
+    }
+
+    return true;
+
+copy:
+    /* We know that the data before offset is zero, so we don't need to read
+     * it again. */
+    memset(dst, 0, offset);
+    memcpy(dst + offset, src + offset, len - offset);
+
+    return false;
+}
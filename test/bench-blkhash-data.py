@@ -30,6 +30,24 @@ for n in bench.threads(args.max_threads):
     )
     runs.append(r)
 
+print(f"\nblkhash-bench --digest-name {args.digest_name} --input-type data --zero-copy\n")
+
+runs = []
+results["data"].append({"name": f"blk-{args.digest_name} zero-copy", "runs": runs})
+
+for n in bench.threads(args.max_threads):
+    r = bench.blkhash(
+        "data",
+        digest_name=args.digest_name,
+        threads=n,
+        zero_copy=True,
+        read_size=args.read_size,
+        block_size=args.block_size,
+        timeout_seconds=args.timeout,
+        cool_down=args.cool_down,
+    )
+    runs.append(r)
+
 print(f"\nblkhash-bench --digest-name {args.digest_name} --input-type data --aio\n")
 
 runs = []
@@ -0,0 +1,69 @@
+#!/usr/bin/env python3
+# SPDX-FileCopyrightText: Red Hat Inc
+# SPDX-License-Identifier: LGPL-2.1-or-later
+"""
+Show how NUMA placement of the workers affects throughput.
+
+The caller thread runs on the first NUMA node, so the input buffers are
+allocated on this node. In the local runs the workers run on the same node.
+In the remote runs the workers run on the last node, hashing data from the
+remote node.
+
+We show both the simple API, copying the data to buffers allocated on the
+workers node, and the async API, hashing the caller buffers directly.
+"""
+
+import os
+import sys
+import bench
+
+args = bench.parse_args()
+
+nodes = bench.numa_nodes()
+if len(nodes) < 2:
+    sys.exit("This benchmark requires at least 2 NUMA nodes with cpus")
+
+local = min(nodes)
+remote = max(nodes)
+max_threads = min(args.max_threads, bench.cpu_count(nodes[local]))
+
+results = bench.results(
+    f"blkhash {args.digest_name} - NUMA placement",
+    host_name=args.host_name,
+)
+results["grid"] = {"axis": "x"}
+
+for aio in (False, True):
+    for name, node in (("local", local), ("remote", remote)):
+        flag = " --aio" if aio else ""
+        print(
+            f"\nblkhash-bench --digest-name {args.digest_name} "
+            f"--input-type data{flag} --numa-node {node} ({name})\n"
+        )
+
+        label = f"blk-{args.digest_name}{' aio' if aio else ''} {name}"
+        runs = []
+        results["data"].append({"name": label, "runs": runs})
+
+        for n in bench.threads(max_threads):
+            r = bench.blkhash(
+                "data",
+                digest_name=args.digest_name,
+                threads=n,
+                aio=aio,
+                queue_depth=args.queue_depth,
+                read_size=args.read_size,
+                block_size=args.block_size,
+                numa_node=node,
+                caller_cpus=nodes[local],
+                timeout_seconds=args.timeout,
+                cool_down=args.cool_down,
+            )
+            runs.append(r)
+
+filename = os.path.join(
+    args.out_dir,
+    "blkhash",
+    f"numa-{args.digest_name}-r{args.read_size}-b{args.block_size}.json",
+)
+bench.write(results, filename)
@@ -110,6 +110,33 @@ def threads(limit=64):
     return [v for v in sorted(samples) if v <= limit]
 
 
+def numa_nodes():
+    """
+    Return a dict mapping NUMA node number to the node cpu list, for nodes
+    with cpus.
+    """
+    nodes = {}
+    for name in sorted(os.listdir("/sys/devices/system/node")):
+        if not name.startswith("node"):
+            continue
+        with open(f"/sys/devices/system/node/{name}/cpulist") as f:
+            cpus = f.read().strip()
+        if cpus:
+            nodes[int(name[4:])] = cpus
+    return nodes
+
+
+def cpu_count(cpus):
+    """
+    Return the number of cpus in cpu list like "0-3,8".
+    """
+    count = 0
+    for part in cpus.split(","):
+        first, _, last = part.partition("-")
+        count += int(last or first) - int(first) + 1
+    return count
+
+
 def results(
     test_name,
     host_name=None,
@@ -148,9 +175,19 @@ def blkhash(
     read_size=READ_SIZE,
     block_size=BLOCK_SIZE,
     threads=4,
+    zero_copy=None,
+    numa_node=None,
+    caller_cpus=None,
     cool_down=COOL_DOWN,
 ):
-    cmd = [
+    cmd = []
+
+    # Run the caller thread on these cpus, allocating the input buffers on
+    # their NUMA node.
+    if caller_cpus:
+        cmd.extend(["taskset", "--cpu-list", caller_cpus])
+
+    cmd += [
         BLKHASH_BENCH,
         f"--input-type={input_type}",
         f"--digest-name={digest_name}",
@@ -170,6 +207,10 @@ def blkhash(
             # threads to ensures that threads has enough work in the queue.
             queue_depth = max(16, threads)
         cmd.append(f"--queue-depth={queue_depth}")
+    if zero_copy:
+        cmd.append("--zero-copy")
+    if numa_node is not None:
+        cmd.append(f"--numa-node={numa_node}")
 
     time.sleep(cool_down)
     return _run_with_stats(cmd)
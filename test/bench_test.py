@@ -35,6 +35,32 @@ def test_blkhash_zero_sha256(threads):
     assert r == checksum(b"\x00" * MiB)
 
 
+@threads_params
+def test_blkhash_data_sha256_zero_copy(threads):
+    r = bench.blkhash(
+        input_type="data",
+        input_size=INPUT_SIZE,
+        digest_name=DIGEST,
+        threads=threads,
+        zero_copy=True,
+        cool_down=0,
+    )["checksum"]
+    assert r == checksum(b"\x55" * MiB)
+
+
+@threads_params
+def test_blkhash_zero_sha256_zero_copy(threads):
+    r = bench.blkhash(
+        input_type="zero",
+        input_size=INPUT_SIZE,
+        digest_name=DIGEST,
+        threads=threads,
+        zero_copy=True,
+        cool_down=0,
+    )["checksum"]
+    assert r == checksum(b"\x00" * MiB)
+
+
 @threads_params
 def test_blkhash_hole_sha256(threads):
     r = bench.blkhash(
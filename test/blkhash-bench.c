@@ -10,6 +10,7 @@
 
 #include "benchmark.h"
 #include "blkhash-config.h"
+#include "blkhash-internal.h"
 #include "blkhash.h"
 #include "util.h"
 
@@ -24,11 +25,15 @@ static const char *digest_name = "sha256";
 static int timeout_seconds = 1;
 static int64_t input_size = 0;
 static bool aio;
+static bool zero_copy;
 static int queue_depth = 16;
 static int threads = 4;
+static int min_threads;
 static int block_size = 64 * KiB;
 static int read_size = 256 * KiB;
 static int64_t hole_size = (int64_t)MIN(16 * GiB, SIZE_MAX);
+static const char *cpus;
+static int numa_node = -1;
 
 static struct request *requests;
 static struct blkhash_completion *completions;
@@ -86,7 +91,7 @@ static void teardown_requests(void)
     free(requests);
 }
 
-static const char *short_options = ":hi:d:T:s:aq:t:b:r:z:";
+static const char *short_options = ":hi:d:T:s:aq:t:m:b:r:z:ZC:N:";
 
 static struct option long_options[] = {
     {"help",                no_argument,        0,  'h'},
@@ -97,9 +102,13 @@ static struct option long_options[] = {
     {"aio",                 no_argument,        0,  'a'},
     {"queue-depth",         required_argument,  0,  'q'},
     {"threads",             required_argument,  0,  't'},
+    {"min-threads",         required_argument,  0,  'm'},
     {"block-size",          required_argument,  0,  'b'},
     {"read-size",           required_argument,  0,  'r'},
     {"hole-size",           required_argument,  0,  'z'},
+    {"zero-copy",           no_argument,        0,  'Z'},
+    {"cpus",                required_argument,  0,  'C'},
+    {"numa-node",           required_argument,  0,  'N'},
     {0,                     0,                  0,  0},
 };
 
@@ -113,9 +122,11 @@ static void usage(int code)
 "                  [-d DIGEST|--digest-name=DIGEST]\n"
 "                  [-T N|--timeout-seconds N] [-s N|--input-size N]\n"
 "                  [-a|--aio] [-q N|--queue-depth N]\n"
-"                  [-t N|--threads N] [-b N|--block-size N]\n"
+"                  [-t N|--threads N] [-m N|--min-threads N]\n"
+"                  [-b N|--block-size N]\n"
 "                  [-r N|--read-size N] [-z N|--hole-size N]\n"
-"                  [-h|--help]\n"
+"                  [-Z|--zero-copy] [-C LIST|--cpus LIST]\n"
+"                  [-N N|--numa-node N] [-h|--help]\n"
 "\n"
 "input types:\n"
 "    data: non-zero data\n"
@@ -167,6 +178,9 @@ static void parse_options(int argc, char *argv[])
         case 't':
             threads = parse_threads(optname, optarg);
             break;
+        case 'm':
+            min_threads = parse_threads(optname, optarg);
+            break;
         case 'b':
             block_size = parse_size(optname, optarg);
             break;
@@ -176,6 +190,15 @@ static void parse_options(int argc, char *argv[])
         case 'z':
             hole_size = parse_size(optname, optarg);
             break;
+        case 'Z':
+            zero_copy = true;
+            break;
+        case 'C':
+            cpus = optarg;
+            break;
+        case 'N':
+            numa_node = parse_count(optname, optarg);
+            break;
         case ':':
             FAILF("Option %s requires an argument", optname);
             break;
@@ -337,6 +360,7 @@ int main(int argc, char *argv[])
     unsigned char md[BLKHASH_MAX_MD_SIZE];
     char md_hex[BLKHASH_MAX_MD_SIZE * 2 + 1];
     unsigned int len;
+    struct wait_stats stats;
     double seconds;
     int err;
 
@@ -362,9 +386,31 @@ int main(int argc, char *argv[])
     if (err)
         FAILF("blkhash_opts_set_block_size: %s", strerror(err));
 
-    err = blkhash_opts_set_threads(opts, threads);
+    if (min_threads) {
+        err = blkhash_opts_set_auto_threads(opts, min_threads, threads);
+        if (err)
+            FAILF("blkhash_opts_set_auto_threads: %s", strerror(err));
+    } else {
+        err = blkhash_opts_set_threads(opts, threads);
+        if (err)
+            FAILF("blkhash_opts_set_threads: %s", strerror(err));
+    }
+
+    err = blkhash_opts_set_zero_copy(opts, zero_copy);
     if (err)
-        FAILF("blkhash_opts_set_threads: %s", strerror(err));
+        FAILF("blkhash_opts_set_zero_copy: %s", strerror(err));
+
+    if (cpus) {
+        err = blkhash_opts_set_cpus(opts, cpus);
+        if (err)
+            FAILF("blkhash_opts_set_cpus: %s", strerror(err));
+    }
+
+    if (numa_node != -1) {
+        err = blkhash_opts_set_numa_node(opts, numa_node);
+        if (err)
+            FAILF("blkhash_opts_set_numa_node: %s", strerror(err));
+    }
 
     h = blkhash_new_opts(opts);
     if (h == NULL)
@@ -389,6 +435,7 @@ int main(int argc, char *argv[])
     if (err)
         FAILF("blkhash_final: %s", strerror(err));
 
+    blkhash_get_wait_stats(h, &stats);
     blkhash_free(h);
 
     elapsed = gettime() - start;
@@ -401,16 +448,24 @@ int main(int argc, char *argv[])
     printf("  \"timeout-seconds\": %d,\n", timeout_seconds);
     printf("  \"input-size\": %" PRIi64 ",\n", input_size);
     printf("  \"aio\": %s,\n", aio ? "true" : "false");
+    printf("  \"zero-copy\": %s,\n", zero_copy ? "true" : "false");
     printf("  \"queue-depth\": %d,\n", queue_depth);
     printf("  \"block-size\": %d,\n", block_size);
     printf("  \"read-size\": %d,\n", read_size);
     printf("  \"hole-size\": %" PRIi64 ",\n", hole_size);
     printf("  \"threads\": %d,\n", threads);
+    printf("  \"min-threads\": %d,\n", min_threads ? min_threads : threads);
+    printf("  \"cpus\": \"%s\",\n", cpus ? cpus : "");
+    printf("  \"numa-node\": %d,\n", numa_node);
     printf("  \"total-size\": %" PRIi64 ",\n", bytes_hashed);
     printf("  \"elapsed\": %.3f,\n", seconds);
     printf("  \"throughput\": %" PRIi64 ",\n", (int64_t)(bytes_hashed / seconds));
     printf("  \"kiops\": %.3f,\n", calls / seconds / 1000);
     printf("  \"gips\": %.3f,\n", bytes_hashed / seconds / GiB);
+    printf("  \"wait-spins\": %" PRIu64 ",\n", stats.spins);
+    printf("  \"wait-spin-usec\": %" PRIu64 ",\n", stats.spin_usec);
+    printf("  \"wait-sleeps\": %" PRIu64 ",\n", stats.sleeps);
+    printf("  \"wait-sleep-usec\": %" PRIu64 ",\n", stats.sleep_usec);
     printf("  \"checksum\": \"%s\"\n", md_hex);
     printf("}\n");
 
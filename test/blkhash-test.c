@@ -2,6 +2,7 @@
 // SPDX-License-Identifier: LGPL-2.1-or-later
 
 #include <errno.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,6 +11,7 @@
 #include "blkhash-config.h"
 #include "blkhash-internal.h"
 #include "blkhash.h"
+#include "digest.h"
 #include "submission.h"
 #include "unity.h"
 #include "util.h"
@@ -28,25 +30,15 @@ struct extent {
     unsigned int len;
 };
 
-void checksum(struct extent *extents, unsigned int len,
-              const char *digest_name, size_t block_size, unsigned threads,
-              char *hexdigest)
+static void checksum_opts(struct extent *extents, unsigned int len,
+                          struct blkhash_opts *opts, char *hexdigest)
 {
-    unsigned char md[digest_len];
-    unsigned int md_len = digest_len;
+    unsigned char md[BLKHASH_MAX_MD_SIZE];
+    unsigned int md_len;
     struct blkhash *h;
-    struct blkhash_opts *opts;
     int err = 0;
 
-    opts = blkhash_opts_new(digest_name);
-    TEST_ASSERT_NOT_NULL_MESSAGE(opts, strerror(errno));
-    err = blkhash_opts_set_block_size(opts, block_size);
-    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
-    err = blkhash_opts_set_threads(opts, threads);
-    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
-
     h = blkhash_new_opts(opts);
-    blkhash_opts_free(opts);
     TEST_ASSERT_NOT_NULL_MESSAGE(h, strerror(errno));
 
     for (unsigned i = 0; i < len; i++) {
@@ -86,6 +78,33 @@ out:
         TEST_FAIL_MESSAGE(strerror(err));
 }
 
+static struct blkhash_opts *create_opts(const char *digest_name,
+                                        size_t block_size, unsigned threads)
+{
+    struct blkhash_opts *opts;
+    int err;
+
+    opts = blkhash_opts_new(digest_name);
+    TEST_ASSERT_NOT_NULL_MESSAGE(opts, strerror(errno));
+    err = blkhash_opts_set_block_size(opts, block_size);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+    err = blkhash_opts_set_threads(opts, threads);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+
+    return opts;
+}
+
+void checksum(struct extent *extents, unsigned int len,
+              const char *digest_name, size_t block_size, unsigned threads,
+              char *hexdigest)
+{
+    struct blkhash_opts *opts;
+
+    opts = create_opts(digest_name, block_size, threads);
+    checksum_opts(extents, len, opts, hexdigest);
+    blkhash_opts_free(opts);
+}
+
 static const char *lookup(const char **array, size_t len, const char *item)
 {
     for (unsigned i = 0; i < len; i++) {
@@ -414,71 +433,1311 @@ void test_mix_unaligned()
     }
 }
 
-void test_abort_quickly()
+void test_zero_md_cache()
+{
+    struct extent extents[] = {
+        {'-', block_size * 4},
+        {'A', block_size},
+        {'\0', block_size * 4},
+    };
+    char seeded[hexdigest_len];
+    char hexdigest[hexdigest_len];
+
+    /* Uses the seeded zero block digest. */
+    checksum(extents, ARRAY_SIZE(extents), "sha256", block_size, 4, seeded);
+
+    /* Computes the zero block digest on the first call, and uses the cached
+     * value on the second. */
+    for (int i = 0; i < 2; i++) {
+        checksum(extents, ARRAY_SIZE(extents), "SHA256", block_size, 4,
+                 hexdigest);
+        TEST_ASSERT_EQUAL_STRING(seeded, hexdigest);
+    }
+}
+
+/* Compute the digest of a zero block without the zero block cache. */
+static void zero_block_digest(const char *name, size_t size,
+                              unsigned char *md, unsigned *md_len)
+{
+    struct digest *digest;
+    unsigned char *buf;
+    int err;
+
+    buf = calloc(1, size);
+    TEST_ASSERT_NOT_NULL(buf);
+
+    err = digest_create(name, &digest);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(-err));
+    err = digest_init(digest);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(-err));
+    err = digest_update(digest, buf, size);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(-err));
+    err = digest_final(digest, md, md_len);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(-err));
+
+    digest_destroy(digest);
+    free(buf);
+}
+
+void test_zero_md_values()
+{
+    const struct {
+        const char *name;
+        size_t block_size;
+    } cases[] = {
+        /* Seeded. */
+        {"sha256", 64 * KiB},
+        /* Unseeded digest. */
+        {"sha512", 64 * KiB},
+        /* Unseeded block size. */
+        {"sha256", 32 * KiB},
+    };
+
+    for (unsigned i = 0; i < ARRAY_SIZE(cases); i++) {
+        unsigned char expected[BLKHASH_MAX_MD_SIZE];
+        unsigned expected_len;
+        struct blkhash_opts *opts;
+        struct config config;
+        int err;
+
+        zero_block_digest(cases[i].name, cases[i].block_size, expected,
+                          &expected_len);
+
+        opts = create_opts(cases[i].name, cases[i].block_size, 1);
+
+        /* Computes unseeded values on the first call, and uses the cached
+         * value on the second. */
+        for (int j = 0; j < 2; j++) {
+            memset(&config, 0, sizeof(config));
+            err = config_init(&config, opts);
+            TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+            TEST_ASSERT_EQUAL_INT(expected_len, config.digests[0].md_len);
+            TEST_ASSERT_EQUAL_MEMORY(expected, config.digests[0].zero_md,
+                                     expected_len);
+        }
+
+        blkhash_opts_free(opts);
+    }
+}
+
+void test_zero_copy()
+{
+    struct extent extents[] = {
+        /* Partial block, copied to the pending buffer. */
+        {'A', block_size / 2},
+        {'-', block_size / 2},
+        {'-', block_size / 2},
+        {'\0', block_size / 2},
+        /* Full blocks, hashed from the caller buffer. */
+        {'E', block_size * 4},
+        {'\0', block_size * 4},
+        {'-', block_size * 4},
+        {'F', block_size / 2},
+    };
+    char expected[hexdigest_len];
+    char hexdigest[hexdigest_len];
+    struct blkhash_opts *opts;
+    int err;
+
+    checksum(extents, ARRAY_SIZE(extents), digest_name, block_size, 1,
+             expected);
+
+    for (unsigned i = 1; i <= threads; i*=2) {
+        opts = create_opts(digest_name, block_size, i);
+        err = blkhash_opts_set_zero_copy(opts, true);
+        TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+        TEST_ASSERT_TRUE(blkhash_opts_get_zero_copy(opts));
+
+        checksum_opts(extents, ARRAY_SIZE(extents), opts, hexdigest);
+        blkhash_opts_free(opts);
+
+        TEST_ASSERT_EQUAL_STRING(expected, hexdigest);
+    }
+}
+
+static int fail_block(const struct blkhash_block *block, void *user_data)
+{
+    const uint64_t *fail_index = user_data;
+
+    return block->index == *fail_index ? EIO : 0;
+}
+
+void test_zero_copy_error()
+{
+    /* More blocks than the hash submissions, so blocks are added to the
+     * outer digest while submitting. */
+    const unsigned blocks = 256;
+    uint64_t fail_index = 8;
+    struct blkhash_opts *opts;
+    struct blkhash *h;
+    unsigned char *buf;
+    int err;
+
+    buf = malloc(block_size * blocks);
+    TEST_ASSERT_NOT_NULL(buf);
+    memset(buf, 'A', block_size * blocks);
+
+    opts = create_opts(digest_name, block_size, 2);
+    blkhash_opts_set_zero_copy(opts, true);
+    blkhash_opts_set_block_callback(opts, fail_block, &fail_index);
+    h = blkhash_new_opts(opts);
+    TEST_ASSERT_NOT_NULL_MESSAGE(h, strerror(errno));
+    blkhash_opts_free(opts);
+
+    err = blkhash_update(h, buf, block_size * blocks);
+    TEST_ASSERT_EQUAL_INT(EIO, err);
+
+    /* The workers must not access the buffer after the update failed. */
+    free(buf);
+
+    blkhash_free(h);
+}
+
+void test_wait_stats()
+{
+    struct wait_stats stats;
+    struct blkhash_opts *opts;
+    unsigned char *buf;
+    struct blkhash *h;
+    size_t len = block_size * 256;
+    int err;
+
+    opts = create_opts(digest_name, block_size, 1);
+    err = blkhash_opts_set_zero_copy(opts, true);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+    h = blkhash_new_opts(opts);
+    TEST_ASSERT_NOT_NULL_MESSAGE(h, strerror(errno));
+    blkhash_opts_free(opts);
+
+    blkhash_get_wait_stats(h, &stats);
+    TEST_ASSERT_EQUAL_UINT64(0, stats.spins + stats.sleeps);
+    TEST_ASSERT_EQUAL_UINT64(0, stats.spin_usec + stats.sleep_usec);
+
+    buf = malloc(len);
+    TEST_ASSERT_NOT_NULL(buf);
+    memset(buf, 'A', len);
+
+    /* Submitting more blocks than the submission queue size and waiting
+     * for all of them with one worker must wait for the worker. */
+    err = blkhash_update(h, buf, len);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+
+    blkhash_get_wait_stats(h, &stats);
+    TEST_ASSERT_TRUE(stats.spins + stats.sleeps > 0);
+
+    free(buf);
+    blkhash_free(h);
+}
+
+void test_shared_pool()
+{
+    struct extent extents[] = {
+        {'A', block_size * 2},
+        {'-', block_size * 8},
+        {'B', block_size / 2},
+        {'\0', block_size * 4},
+        {'C', block_size * 3},
+    };
+    struct {
+        const char *digest_name;
+        size_t block_size;
+    } hashes[] = {
+        {"sha256", block_size},
+        {"sha256", block_size / 4},
+        {"sha512", block_size},
+    };
+    char expected[ARRAY_SIZE(hashes)][hexdigest_len * 2];
+    char hexdigest[hexdigest_len * 2];
+    struct blkhash_pool *pool;
+    int err;
+
+    for (unsigned i = 0; i < ARRAY_SIZE(hashes); i++)
+        checksum(extents, ARRAY_SIZE(extents), hashes[i].digest_name,
+                 hashes[i].block_size, 4, expected[i]);
+
+    TEST_ASSERT_NULL(blkhash_pool_new(0));
+    TEST_ASSERT_EQUAL_INT(EINVAL, errno);
+
+    pool = blkhash_pool_new(4);
+    TEST_ASSERT_NOT_NULL_MESSAGE(pool, strerror(errno));
+
+    /* Hashes using the same pool one after another. */
+    for (unsigned i = 0; i < ARRAY_SIZE(hashes); i++) {
+        struct blkhash_opts *opts;
+
+        opts = create_opts(hashes[i].digest_name, hashes[i].block_size, 4);
+        err = blkhash_opts_set_pool(opts, pool);
+        TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+        TEST_ASSERT_TRUE(blkhash_opts_get_pool(opts) == pool);
+
+        checksum_opts(extents, ARRAY_SIZE(extents), opts, hexdigest);
+        blkhash_opts_free(opts);
+
+        TEST_ASSERT_EQUAL_STRING(expected[i], hexdigest);
+    }
+
+    /* Hashes using the same pool at the same time. */
+    {
+        struct blkhash *h[ARRAY_SIZE(hashes)];
+        unsigned char md[BLKHASH_MAX_MD_SIZE];
+        unsigned char *buf;
+
+        for (unsigned i = 0; i < ARRAY_SIZE(hashes); i++) {
+            struct blkhash_opts *opts;
+
+            opts = create_opts(hashes[i].digest_name, hashes[i].block_size, 4);
+            blkhash_opts_set_pool(opts, pool);
+            h[i] = blkhash_new_opts(opts);
+            TEST_ASSERT_NOT_NULL_MESSAGE(h[i], strerror(errno));
+            blkhash_opts_free(opts);
+        }
+
+        for (unsigned e = 0; e < ARRAY_SIZE(extents); e++) {
+            buf = malloc(extents[e].len);
+            TEST_ASSERT_NOT_NULL(buf);
+            memset(buf, extents[e].byte, extents[e].len);
+
+            for (unsigned i = 0; i < ARRAY_SIZE(hashes); i++) {
+                if (extents[e].byte == '-')
+                    err = blkhash_zero(h[i], extents[e].len);
+                else
+                    err = blkhash_update(h[i], buf, extents[e].len);
+                TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+            }
+
+            free(buf);
+        }
+
+        for (unsigned i = 0; i < ARRAY_SIZE(hashes); i++) {
+            unsigned md_len;
+
+            err = blkhash_final(h[i], md, &md_len);
+            TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+            blkhash_free(h[i]);
+
+            format_hex(md, md_len, hexdigest);
+            TEST_ASSERT_EQUAL_STRING(expected[i], hexdigest);
+        }
+    }
+
+    blkhash_pool_free(pool);
+}
+
+void test_shared_pool_free()
+{
+    /* More submissions than the shared queues can hold, so submitters wait
+     * for the workers, and hashes are freed while the workers are busy with
+     * other hashes. Hashes starting with a zero block are freed while the
+     * worker batches their block with blocks of other hashes. */
+    const size_t small_block_size = 4096;
+    const unsigned hashes_count = 8;
+    const unsigned blocks = 512;
+    struct blkhash *h[hashes_count];
+    struct blkhash *zero_hash;
+    struct blkhash_pool *pool;
+    unsigned char *buf;
+    unsigned char *zeros;
+    int err;
+
+    buf = malloc(small_block_size * blocks);
+    TEST_ASSERT_NOT_NULL(buf);
+    memset(buf, 'A', small_block_size * blocks);
+
+    zeros = calloc(1, small_block_size);
+    TEST_ASSERT_NOT_NULL(zeros);
+
+    pool = blkhash_pool_new(2);
+    TEST_ASSERT_NOT_NULL_MESSAGE(pool, strerror(errno));
+
+    for (unsigned round = 0; round < 10; round++) {
+        for (unsigned i = 0; i < hashes_count; i++) {
+            struct blkhash_opts *opts;
+
+            opts = create_opts("sha256", small_block_size, 2);
+            err = blkhash_opts_set_queue_depth(opts, 128);
+            TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+            blkhash_opts_set_pool(opts, pool);
+            h[i] = blkhash_new_opts(opts);
+            TEST_ASSERT_NOT_NULL_MESSAGE(h[i], strerror(errno));
+            blkhash_opts_free(opts);
+
+            err = blkhash_update(h[i], buf, small_block_size * blocks);
+            TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+
+            /* A hash with only a zero block, completed by the worker while
+             * batching it with the blocks of other hashes. */
+            opts = create_opts("sha256", small_block_size, 2);
+            blkhash_opts_set_zero_copy(opts, true);
+            blkhash_opts_set_pool(opts, pool);
+            zero_hash = blkhash_new_opts(opts);
+            TEST_ASSERT_NOT_NULL_MESSAGE(zero_hash, strerror(errno));
+            blkhash_opts_free(opts);
+
+            err = blkhash_update(zero_hash, zeros, small_block_size);
+            TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+            blkhash_free(zero_hash);
+        }
+
+        for (unsigned i = 0; i < hashes_count; i++)
+            blkhash_free(h[i]);
+    }
+
+    blkhash_pool_free(pool);
+    free(zeros);
+    free(buf);
+}
+
+void test_reset()
 {
+    struct extent extents[][3] = {
+        {{'A', block_size * 2}, {'-', block_size * 8}, {'B', block_size / 2}},
+        {{'\0', block_size}, {'C', block_size * 3}, {'-', block_size / 3}},
+    };
+    char expected[ARRAY_SIZE(extents)][hexdigest_len];
+    char hexdigest[hexdigest_len];
+    unsigned char md[BLKHASH_MAX_MD_SIZE];
+    unsigned char *buf;
     struct blkhash *h;
     int err;
 
+    for (unsigned i = 0; i < ARRAY_SIZE(extents); i++)
+        checksum(extents[i], ARRAY_SIZE(extents[i]), digest_name, block_size,
+                 4, expected[i]);
+
     h = blkhash_new();
     TEST_ASSERT_NOT_NULL_MESSAGE(h, strerror(errno));
 
-    for (int i = 0; i < 10; i++) {
-        err = blkhash_zero(h, 3 * GiB);
-        if (err)
-            break;
+    buf = malloc(block_size * 8);
+    TEST_ASSERT_NOT_NULL(buf);
+
+    /* Reset after starting a hash, after finalizing, and after reusing. */
+    for (unsigned round = 0; round < 3; round++) {
+        struct extent *e = extents[round % ARRAY_SIZE(extents)];
+
+        for (unsigned i = 0; i < ARRAY_SIZE(extents[0]); i++) {
+            if (e[i].byte == '-') {
+                err = blkhash_zero(h, e[i].len);
+            } else {
+                memset(buf, e[i].byte, e[i].len);
+                err = blkhash_update(h, buf, e[i].len);
+            }
+            TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+        }
+
+        if (round > 0) {
+            err = blkhash_final(h, md, NULL);
+            TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+
+            format_hex(md, digest_len, hexdigest);
+            TEST_ASSERT_EQUAL_STRING(expected[round % ARRAY_SIZE(extents)],
+                                     hexdigest);
+        }
+
+        err = blkhash_reset(h);
+        TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
     }
 
+    free(buf);
     blkhash_free(h);
+}
 
-    /* TODO: check that workers were stopped without doing any work. */
+void test_reset_aio()
+{
+    struct blkhash_completion completions[1];
+    struct blkhash_opts *opts;
+    unsigned char *buf;
+    struct blkhash *h;
+    int count = 0;
+    int err;
+
+    opts = create_opts(digest_name, block_size, 4);
+    err = blkhash_opts_set_queue_depth(opts, 1);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+    h = blkhash_new_opts(opts);
+    TEST_ASSERT_NOT_NULL_MESSAGE(h, strerror(errno));
+    blkhash_opts_free(opts);
+
+    buf = malloc(block_size * 4);
+    TEST_ASSERT_NOT_NULL(buf);
+    memset(buf, 'A', block_size * 4);
+
+    err = blkhash_aio_update(h, buf, block_size * 4, NULL);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+
+    /* Cannot reset before the async update is reaped. */
+    err = blkhash_reset(h);
+    TEST_ASSERT_EQUAL_INT(EBUSY, err);
+
+    while (count == 0) {
+        count = blkhash_aio_completions(h, completions, 1);
+        TEST_ASSERT_TRUE(count >= 0);
+    }
+
+    err = blkhash_reset(h);
     TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+
+    free(buf);
+    blkhash_free(h);
 }
 
-static void check_false_sharing(const char *name, size_t type_size)
+void test_busy_poll()
 {
-    if (type_size % CACHE_LINE_SIZE != 0) {
-        size_t padding = CACHE_LINE_SIZE - (type_size % CACHE_LINE_SIZE);
+    struct extent extents[] = {{'A', block_size * 16}};
+    struct blkhash_completion completions[4];
+    char expected[hexdigest_len];
+    char hexdigest[hexdigest_len];
+    unsigned char md[BLKHASH_MAX_MD_SIZE];
+    struct blkhash_opts *opts;
+    struct pollfd pfd;
+    unsigned char *buf;
+    struct blkhash *h;
+    unsigned reaped = 0;
+    int err;
 
-        printf("WARNING: %s is not aligned to cache line size\n", name);
-        printf("  type size: %ld\n", type_size);
-        printf("  cache line size: %d\n", CACHE_LINE_SIZE);
-        printf("  needs padding: %ld\n", padding);
+    checksum(extents, 1, digest_name, block_size, 4, expected);
+
+    opts = create_opts(digest_name, block_size, 4);
+    err = blkhash_opts_set_queue_depth(opts, 4);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+    err = blkhash_opts_set_busy_poll(opts, 100);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+    h = blkhash_new_opts(opts);
+    TEST_ASSERT_NOT_NULL_MESSAGE(h, strerror(errno));
+    blkhash_opts_free(opts);
+
+    buf = malloc(block_size * 16);
+    TEST_ASSERT_NOT_NULL(buf);
+    memset(buf, 'A', block_size * 16);
+
+    for (unsigned i = 0; i < 4; i++) {
+        err = blkhash_aio_update(h, buf + i * block_size * 4,
+                                 block_size * 4, NULL);
+        TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+    }
+
+    pfd.fd = blkhash_aio_completion_fd(h);
+    pfd.events = POLLIN;
+
+    while (reaped < 4) {
+        int count = blkhash_aio_completions(h, completions, 4);
+        TEST_ASSERT_TRUE(count >= 0);
+
+        if (count > 0) {
+            reaped += count;
+            continue;
+        }
+
+        /* No completions, so the completion fd was armed. */
+        err = poll(&pfd, 1, 10000);
+        TEST_ASSERT_EQUAL_INT(1, err);
+
+        char sink[8];
+        err = read(pfd.fd, sink, sizeof(sink));
+        TEST_ASSERT_TRUE(err > 0);
     }
+
+    err = blkhash_final(h, md, NULL);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+    format_hex(md, digest_len, hexdigest);
+    TEST_ASSERT_EQUAL_STRING(expected, hexdigest);
+
+    free(buf);
+    blkhash_free(h);
 }
 
-void test_false_sharing()
+struct completion_records {
+    unsigned count;
+    int error;
+};
+
+static void record_completion(const struct blkhash_completion *completion,
+                              void *user_data)
 {
-    check_false_sharing("struct config", sizeof(struct config));
-    check_false_sharing("struct submission", sizeof(struct submission));
+    struct completion_records *records = user_data;
+
+    if (completion->error)
+        __atomic_store_n(&records->error, completion->error, __ATOMIC_RELAXED);
+
+    /* Pairs with the load in test_completion_callback(). */
+    __atomic_add_fetch(&records->count, 1, __ATOMIC_RELEASE);
 }
 
-int main(void)
+void test_completion_callback()
 {
-    UNITY_BEGIN();
+    struct extent extents[] = {{'A', block_size * 16}};
+    struct completion_records records = {0};
+    struct blkhash_completion completions[4];
+    char expected[hexdigest_len];
+    char hexdigest[hexdigest_len];
+    unsigned char md[BLKHASH_MAX_MD_SIZE];
+    struct blkhash_opts *opts;
+    unsigned char *buf;
+    struct blkhash *h;
+    int err;
 
-    RUN_TEST(test_digests);
+    checksum(extents, 1, digest_name, block_size, 4, expected);
 
-    RUN_TEST(test_block_data);
-    RUN_TEST(test_block_data_zero);
-    RUN_TEST(test_block_zero);
+    opts = create_opts(digest_name, block_size, 4);
+    err = blkhash_opts_set_queue_depth(opts, 4);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+    err = blkhash_opts_set_completion_callback(opts, record_completion,
+                                               &records);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+    h = blkhash_new_opts(opts);
+    TEST_ASSERT_NOT_NULL_MESSAGE(h, strerror(errno));
+    blkhash_opts_free(opts);
 
-    RUN_TEST(test_partial_block_data);
-    RUN_TEST(test_partial_block_data_zero);
-    RUN_TEST(test_partial_block_zero);
+    /* Completions are not delivered using the completion fd. */
+    TEST_ASSERT_EQUAL_INT(-ENOTSUP, blkhash_aio_completion_fd(h));
+    TEST_ASSERT_EQUAL_INT(-ENOTSUP, blkhash_aio_completions(h, completions, 4));
 
-    RUN_TEST(test_sparse);
-    RUN_TEST(test_sparse_unaligned);
-    RUN_TEST(test_sparse_large);
+    buf = malloc(block_size * 16);
+    TEST_ASSERT_NOT_NULL(buf);
+    memset(buf, 'A', block_size * 16);
 
-    RUN_TEST(test_zero);
-    RUN_TEST(test_zero_unaligned);
+    for (unsigned i = 0; i < 4; i++) {
+        err = blkhash_aio_update(h, buf + i * block_size * 4,
+                                 block_size * 4, NULL);
+        TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+    }
 
-    RUN_TEST(test_full);
-    RUN_TEST(test_full_unaligned);
+    while (__atomic_load_n(&records.count, __ATOMIC_ACQUIRE) < 4)
+        usleep(1000);
+
+    TEST_ASSERT_EQUAL_INT(0, records.error);
+
+    err = blkhash_final(h, md, NULL);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+    format_hex(md, digest_len, hexdigest);
+    TEST_ASSERT_EQUAL_STRING(expected, hexdigest);
+
+    free(buf);
+    blkhash_free(h);
+}
+
+void test_auto_threads()
+{
+    struct extent extents[] = {
+        {'A', block_size * 256},
+        {'\0', block_size * 64},
+        {'-', block_size * 64},
+        {'B', block_size * 256},
+        {'C', block_size / 2},
+    };
+    char expected[hexdigest_len];
+    char hexdigest[hexdigest_len];
+    struct blkhash_opts *opts;
+    int err;
+
+    checksum(extents, ARRAY_SIZE(extents), digest_name, block_size, 1,
+             expected);
+
+    opts = create_opts(digest_name, block_size, 4);
+    TEST_ASSERT_EQUAL_INT(4, blkhash_opts_get_min_threads(opts));
+
+    err = blkhash_opts_set_auto_threads(opts, 0, 8);
+    TEST_ASSERT_EQUAL_INT(EINVAL, err);
+    err = blkhash_opts_set_auto_threads(opts, 9, 8);
+    TEST_ASSERT_EQUAL_INT(EINVAL, err);
+    err = blkhash_opts_set_auto_threads(opts, 1, 129);
+    TEST_ASSERT_EQUAL_INT(EINVAL, err);
+
+    err = blkhash_opts_set_auto_threads(opts, 1, 16);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+    TEST_ASSERT_EQUAL_INT(1, blkhash_opts_get_min_threads(opts));
+    TEST_ASSERT_EQUAL_INT(16, blkhash_opts_get_threads(opts));
+
+    checksum_opts(extents, ARRAY_SIZE(extents), opts, hexdigest);
+    TEST_ASSERT_EQUAL_STRING(expected, hexdigest);
+
+    /* Setting the number of threads disables autoscaling. */
+    err = blkhash_opts_set_threads(opts, 2);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+    TEST_ASSERT_EQUAL_INT(2, blkhash_opts_get_min_threads(opts));
+
+    blkhash_opts_free(opts);
+}
+
+void test_cpus()
+{
+    struct extent extents[] = {
+        {'A', block_size * 4},
+        {'\0', block_size * 4},
+        {'-', block_size * 4},
+        {'B', block_size / 2},
+    };
+    const char *invalid[] = {"", "a", "-1", "1-", "3-1", "0,", "0,,1",
+                             " 0", "1024"};
+    char expected[hexdigest_len];
+    char hexdigest[hexdigest_len];
+    struct blkhash_opts *opts;
+    int err;
+
+    checksum(extents, ARRAY_SIZE(extents), digest_name, block_size, 1,
+             expected);
+
+    opts = create_opts(digest_name, block_size, 4);
+
+    for (unsigned i = 0; i < ARRAY_SIZE(invalid); i++) {
+        err = blkhash_opts_set_cpus(opts, invalid[i]);
+        TEST_ASSERT_EQUAL_INT_MESSAGE(EINVAL, err, invalid[i]);
+    }
+
+    err = blkhash_opts_set_numa_node(opts, -2);
+    TEST_ASSERT_EQUAL_INT(EINVAL, err);
+
+    /* The only CPU available on every host. */
+    err = blkhash_opts_set_cpus(opts, "0");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+
+    checksum_opts(extents, ARRAY_SIZE(extents), opts, hexdigest);
+    TEST_ASSERT_EQUAL_STRING(expected, hexdigest);
+
+    /* NUMA information is not available in some environments. */
+    err = blkhash_opts_set_numa_node(opts, 0);
+    if (err != ENOTSUP) {
+        TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+
+        checksum_opts(extents, ARRAY_SIZE(extents), opts, hexdigest);
+        TEST_ASSERT_EQUAL_STRING(expected, hexdigest);
+    }
+
+    err = blkhash_opts_set_cpus(opts, NULL);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+
+    checksum_opts(extents, ARRAY_SIZE(extents), opts, hexdigest);
+    TEST_ASSERT_EQUAL_STRING(expected, hexdigest);
+
+    blkhash_opts_free(opts);
+}
+
+void test_multiple_digests()
+{
+    struct extent extents[] = {
+        {'A', block_size * 2},
+        {'-', block_size * 8},
+        {'\0', block_size * 4},
+        {'B', block_size / 2},
+    };
+    const char *names[] = {"sha256", "sha512", "sha1"};
+    char expected[ARRAY_SIZE(names)][hexdigest_len * 2];
+    char hexdigest[hexdigest_len * 2];
+    unsigned char md[BLKHASH_MAX_MD_SIZE];
+    unsigned int md_len;
+    struct blkhash_opts *opts;
+    struct blkhash *h;
+    int err;
+
+    for (unsigned i = 0; i < ARRAY_SIZE(names); i++)
+        checksum(extents, ARRAY_SIZE(extents), names[i], block_size, 4,
+                 expected[i]);
+
+    opts = create_opts(names[0], block_size, 4);
+    for (unsigned i = 1; i < ARRAY_SIZE(names); i++) {
+        err = blkhash_opts_add_digest(opts, names[i]);
+        TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+    }
+
+    /* blkhash_final() returns the first digest. */
+    checksum_opts(extents, ARRAY_SIZE(extents), opts, hexdigest);
+    TEST_ASSERT_EQUAL_STRING(expected[0], hexdigest);
+
+    h = blkhash_new_opts(opts);
+    TEST_ASSERT_NOT_NULL_MESSAGE(h, strerror(errno));
+
+    err = blkhash_get_digest(h, 0, md, &md_len);
+    TEST_ASSERT_EQUAL_INT(EINVAL, err);
+
+    for (unsigned i = 0; i < ARRAY_SIZE(extents); i++) {
+        if (extents[i].byte == '-') {
+            err = blkhash_zero(h, extents[i].len);
+        } else {
+            unsigned char *buf = malloc(extents[i].len);
+            TEST_ASSERT_NOT_NULL(buf);
+            memset(buf, extents[i].byte, extents[i].len);
+            err = blkhash_update(h, buf, extents[i].len);
+            free(buf);
+        }
+        TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+    }
+
+    err = blkhash_final(h, md, &md_len);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+
+    for (unsigned i = 0; i < ARRAY_SIZE(names); i++) {
+        err = blkhash_get_digest(h, i, md, &md_len);
+        TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+        format_hex(md, md_len, hexdigest);
+        TEST_ASSERT_EQUAL_STRING(expected[i], hexdigest);
+    }
+
+    err = blkhash_get_digest(h, ARRAY_SIZE(names), md, &md_len);
+    TEST_ASSERT_EQUAL_INT(EINVAL, err);
+
+    blkhash_free(h);
+
+    /* Cannot add more than BLKHASH_MAX_DIGESTS. */
+    err = blkhash_opts_add_digest(opts, "sha256");
+    TEST_ASSERT_EQUAL_INT(0, err);
+    err = blkhash_opts_add_digest(opts, "sha256");
+    TEST_ASSERT_EQUAL_INT(EINVAL, err);
+
+    blkhash_opts_free(opts);
+}
+
+struct block_record {
+    uint64_t index;
+    uint64_t count;
+    uint64_t len;
+    unsigned char md[BLKHASH_MAX_MD_SIZE];
+    bool zero;
+};
+
+struct block_records {
+    struct block_record array[16];
+    unsigned count;
+};
+
+static int record_block(const struct blkhash_block *block, void *user_data)
+{
+    struct block_records *records = user_data;
+    struct block_record *r;
+
+    if (records->count == ARRAY_SIZE(records->array))
+        return ENOSPC;
+
+    r = &records->array[records->count++];
+    r->index = block->index;
+    r->count = block->count;
+    r->len = block->len;
+    r->zero = block->zero;
+    memcpy(r->md, block->md[0], block->md_len[0]);
+
+    return 0;
+}
+
+static void block_digest(char byte, size_t len, unsigned char *md)
+{
+    unsigned char *buf;
+    struct digest *d;
+    int err;
+
+    buf = malloc(len);
+    TEST_ASSERT_NOT_NULL(buf);
+    memset(buf, byte, len);
+
+    err = digest_create(digest_name, &d);
+    TEST_ASSERT_EQUAL_INT(0, err);
+    TEST_ASSERT_EQUAL_INT(0, digest_init(d));
+    TEST_ASSERT_EQUAL_INT(0, digest_update(d, buf, len));
+    TEST_ASSERT_EQUAL_INT(0, digest_final(d, md, NULL));
+
+    digest_destroy(d);
+    free(buf);
+}
+
+void test_block_callback()
+{
+    struct extent extents[] = {
+        {'A', block_size},
+        /* Zero blocks from holes and zero data are one run. */
+        {'-', block_size * 2000},
+        {'\0', block_size * 2},
+        {'-', block_size / 2},
+        {'-', block_size / 2},
+        {'B', block_size},
+        {'C', block_size / 2},
+    };
+    struct block_record expected[] = {
+        {.index = 0, .count = 1, .len = block_size},
+        {.index = 1, .count = 2003, .len = block_size, .zero = true},
+        {.index = 2004, .count = 1, .len = block_size},
+        {.index = 2005, .count = 1, .len = block_size / 2},
+    };
+    struct block_records records = {0};
+    char hexdigest[hexdigest_len];
+    char without_callback[hexdigest_len];
+    struct blkhash_opts *opts;
+    int err;
+
+    block_digest('A', block_size, expected[0].md);
+    block_digest('\0', block_size, expected[1].md);
+    block_digest('B', block_size, expected[2].md);
+    block_digest('C', block_size / 2, expected[3].md);
+
+    checksum(extents, ARRAY_SIZE(extents), digest_name, block_size, 4,
+             without_callback);
+
+    opts = create_opts(digest_name, block_size, 4);
+    err = blkhash_opts_set_block_callback(opts, record_block, &records);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+
+    checksum_opts(extents, ARRAY_SIZE(extents), opts, hexdigest);
+    blkhash_opts_free(opts);
+
+    TEST_ASSERT_EQUAL_STRING(without_callback, hexdigest);
+    TEST_ASSERT_EQUAL_UINT(ARRAY_SIZE(expected), records.count);
+
+    for (unsigned i = 0; i < ARRAY_SIZE(expected); i++) {
+        struct block_record *r = &records.array[i];
+
+        TEST_ASSERT_EQUAL_UINT64(expected[i].index, r->index);
+        TEST_ASSERT_EQUAL_UINT64(expected[i].count, r->count);
+        TEST_ASSERT_EQUAL_UINT64(expected[i].len, r->len);
+        TEST_ASSERT_EQUAL_INT(expected[i].zero, r->zero);
+        TEST_ASSERT_EQUAL_MEMORY(expected[i].md, r->md, digest_len);
+    }
+}
+
+void test_incremental_rehash()
+{
+    /* One byte per block, '-' for a hole. The last block is partial. */
+    const char old_blocks[] = "AB---CDE";
+    const char new_blocks[] = "AX-Y-CDF";
+    const bool dirty[] = {0, 1, 0, 1, 0, 0, 0, 1};
+    const unsigned count = sizeof(old_blocks) - 1;
+    struct extent extents[sizeof(old_blocks) - 1];
+    struct block_records records = {0};
+    char expected[hexdigest_len];
+    char hexdigest[hexdigest_len];
+    unsigned char md[BLKHASH_MAX_MD_SIZE];
+    struct blkhash_opts *opts;
+    struct blkhash *h;
+    unsigned char *buf;
+    int err;
+
+    /* Compute the block digests of the old image. */
+    for (unsigned i = 0; i < count; i++) {
+        extents[i].byte = old_blocks[i];
+        extents[i].len = i < count - 1 ? block_size : block_size / 2;
+    }
+
+    opts = create_opts(digest_name, block_size, 4);
+    blkhash_opts_set_block_callback(opts, record_block, &records);
+    checksum_opts(extents, count, opts, hexdigest);
+    blkhash_opts_free(opts);
+
+    /* Hash the new image. */
+    for (unsigned i = 0; i < count; i++)
+        extents[i].byte = new_blocks[i];
+
+    checksum(extents, count, digest_name, block_size, 4, expected);
+
+    /* Hash only the dirty blocks, using the old block digests for the rest. */
+    h = blkhash_new();
+    TEST_ASSERT_NOT_NULL_MESSAGE(h, strerror(errno));
+
+    buf = malloc(block_size);
+    TEST_ASSERT_NOT_NULL(buf);
+
+    for (unsigned i = 0; i < count; i++) {
+        if (dirty[i]) {
+            if (extents[i].byte == '-') {
+                err = blkhash_zero(h, extents[i].len);
+            } else {
+                memset(buf, extents[i].byte, extents[i].len);
+                err = blkhash_update(h, buf, extents[i].len);
+            }
+        } else {
+            struct block_record *r = NULL;
+            struct blkhash_block block = {0};
+
+            for (unsigned j = 0; j < records.count; j++) {
+                r = &records.array[j];
+                if (r->index <= i && i < r->index + r->count)
+                    break;
+            }
+
+            block.index = i;
+            block.count = 1;
+            block.len = r->len;
+            block.md[0] = r->md;
+            block.md_len[0] = digest_len;
+            block.zero = r->zero;
+
+            err = blkhash_add_block(h, &block);
+        }
+        TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+    }
+
+    /* Adding a block at the wrong index fails. */
+    {
+        struct blkhash_block block = {
+            .index = 0,
+            .count = 1,
+            .len = block_size,
+            .md = {records.array[0].md},
+            .md_len = {digest_len},
+        };
+        err = blkhash_add_block(h, &block);
+        TEST_ASSERT_EQUAL_INT(EINVAL, err);
+    }
+
+    err = blkhash_final(h, md, NULL);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+
+    format_hex(md, digest_len, hexdigest);
+    TEST_ASSERT_EQUAL_STRING(expected, hexdigest);
+
+    blkhash_free(h);
+
+    /* Adding the last partial block fails, since the hash would include a
+     * full block instead. */
+    h = blkhash_new();
+    TEST_ASSERT_NOT_NULL_MESSAGE(h, strerror(errno));
+
+    err = blkhash_zero(h, block_size * (count - 1));
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+
+    {
+        struct block_record *r = &records.array[records.count - 1];
+        struct blkhash_block block = {
+            .index = r->index,
+            .count = r->count,
+            .len = r->len,
+            .md = {r->md},
+            .md_len = {digest_len},
+        };
+
+        TEST_ASSERT_EQUAL_UINT64(count - 1, r->index);
+        TEST_ASSERT_EQUAL_UINT64(block_size / 2, r->len);
+
+        err = blkhash_add_block(h, &block);
+        TEST_ASSERT_EQUAL_INT(EINVAL, err);
+    }
+
+    /* The hash did not fail. */
+    err = blkhash_final(h, md, NULL);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+
+    free(buf);
+    blkhash_free(h);
+}
+
+static void add_extents(struct blkhash *h, struct extent *extents,
+                        unsigned int len)
+{
+    unsigned char *buf;
+    int err;
+
+    for (unsigned i = 0; i < len; i++) {
+        struct extent *e = &extents[i];
+
+        if (e->byte == '-') {
+            err = blkhash_zero(h, e->len);
+        } else {
+            buf = malloc(e->len);
+            TEST_ASSERT_NOT_NULL(buf);
+            memset(buf, e->byte, e->len);
+            err = blkhash_update(h, buf, e->len);
+            free(buf);
+        }
+        TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+    }
+}
+
+void test_save_state()
+{
+    /* The state is saved after the third extent, with pending data. */
+    struct extent extents[] = {
+        {'A', block_size * 3},
+        {'-', block_size * 2000},
+        {'B', block_size / 2},
+        {'-', block_size * 3},
+        {'C', block_size + 100},
+        {'-', block_size * 4 - 100},
+    };
+    const unsigned saved = 3;
+    const unsigned count = ARRAY_SIZE(extents);
+    char expected[hexdigest_len];
+    char hexdigest[hexdigest_len];
+    unsigned char md[BLKHASH_MAX_MD_SIZE];
+    struct blkhash_opts *opts;
+    struct blkhash *h;
+    void *state;
+    size_t len = 0;
+    int err;
+
+    checksum(extents, count, digest_name, block_size, 4, expected);
+
+    opts = create_opts(digest_name, block_size, 4);
+    err = blkhash_opts_set_resumable(opts, true);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+
+    h = blkhash_new_opts(opts);
+    TEST_ASSERT_NOT_NULL_MESSAGE(h, strerror(errno));
+
+    err = blkhash_save_state(h, NULL, &len);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+
+    state = malloc(len);
+    TEST_ASSERT_NOT_NULL(state);
+
+    add_extents(h, extents, saved);
+
+    err = blkhash_save_state(h, state, &len);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+
+    /* Saving does not modify the hash. */
+    add_extents(h, &extents[saved], count - saved);
+    err = blkhash_final(h, md, NULL);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+    format_hex(md, digest_len, hexdigest);
+    TEST_ASSERT_EQUAL_STRING(expected, hexdigest);
+
+    blkhash_free(h);
+
+    /* Resume hashing in a new hash. */
+    h = blkhash_new_opts(opts);
+    TEST_ASSERT_NOT_NULL_MESSAGE(h, strerror(errno));
+
+    err = blkhash_load_state(h, state, len);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+
+    add_extents(h, &extents[saved], count - saved);
+    err = blkhash_final(h, md, NULL);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+    format_hex(md, digest_len, hexdigest);
+    TEST_ASSERT_EQUAL_STRING(expected, hexdigest);
+
+    blkhash_free(h);
+    blkhash_opts_free(opts);
+
+    /* The state does not match a hash with another block size. */
+    opts = create_opts(digest_name, block_size * 2, 4);
+    blkhash_opts_set_resumable(opts, true);
+    h = blkhash_new_opts(opts);
+    TEST_ASSERT_NOT_NULL_MESSAGE(h, strerror(errno));
+
+    err = blkhash_load_state(h, state, len);
+    TEST_ASSERT_EQUAL_INT(EINVAL, err);
+
+    blkhash_free(h);
+    blkhash_opts_free(opts);
+
+    /* The state cannot be loaded into a partial hash. */
+    opts = create_opts(digest_name, block_size, 4);
+    blkhash_opts_set_resumable(opts, true);
+    blkhash_opts_set_partial(opts, true);
+    h = blkhash_new_opts(opts);
+    TEST_ASSERT_NOT_NULL_MESSAGE(h, strerror(errno));
+
+    err = blkhash_load_state(h, state, len);
+    TEST_ASSERT_EQUAL_INT(EINVAL, err);
+
+    blkhash_free(h);
+    blkhash_opts_free(opts);
+
+    /* Without the resumable option the state cannot be saved or loaded. */
+    opts = create_opts(digest_name, block_size, 4);
+    h = blkhash_new_opts(opts);
+    TEST_ASSERT_NOT_NULL_MESSAGE(h, strerror(errno));
+
+    err = blkhash_save_state(h, NULL, &len);
+    TEST_ASSERT_EQUAL_INT(ENOTSUP, err);
+
+    err = blkhash_load_state(h, state, len);
+    TEST_ASSERT_EQUAL_INT(ENOTSUP, err);
+
+    blkhash_free(h);
+    blkhash_opts_free(opts);
+    free(state);
+}
+
+static void hash_partial(struct extent *extents, unsigned int len,
+                         struct blkhash *merged)
+{
+    struct blkhash_opts *opts;
+    struct blkhash *h;
+    const void *buf;
+    size_t buf_len;
+    int err;
+
+    opts = create_opts(digest_name, block_size, 4);
+    blkhash_opts_set_partial(opts, true);
+
+    h = blkhash_new_opts(opts);
+    TEST_ASSERT_NOT_NULL_MESSAGE(h, strerror(errno));
+    blkhash_opts_free(opts);
+
+    add_extents(h, extents, len);
+
+    err = blkhash_final_partial(h, &buf, &buf_len);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+
+    err = blkhash_add_partial(merged, buf, buf_len);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+
+    blkhash_free(h);
+}
+
+void test_partial()
+{
+    /* Three ranges; only the last range is not aligned to block size. */
+    struct extent extents[] = {
+        {'A', block_size * 3},
+        {'-', block_size * 2000},
+        {'B', block_size},
+        {'-', block_size * 3},
+        {'C', block_size * 2},
+        {'-', block_size * 4},
+        {'D', block_size / 2},
+    };
+    const unsigned count = ARRAY_SIZE(extents);
+    char expected[hexdigest_len];
+    char hexdigest[hexdigest_len];
+    unsigned char md[BLKHASH_MAX_MD_SIZE];
+    struct blkhash_opts *opts;
+    struct blkhash *merged;
+    struct blkhash *h;
+    const void *buf;
+    size_t len;
+    int err;
+
+    checksum(extents, count, digest_name, block_size, 4, expected);
+
+    /* Merge the first two ranges to a partial state, and add the last
+     * range. */
+    opts = create_opts(digest_name, block_size, 4);
+    blkhash_opts_set_partial(opts, true);
+    merged = blkhash_new_opts(opts);
+    TEST_ASSERT_NOT_NULL_MESSAGE(merged, strerror(errno));
+    blkhash_opts_free(opts);
+
+    hash_partial(&extents[0], 2, merged);
+    hash_partial(&extents[2], 3, merged);
+
+    /* A partial hash does not compute a message digest. */
+    err = blkhash_final(merged, md, NULL);
+    TEST_ASSERT_EQUAL_INT(EINVAL, err);
+
+    err = blkhash_final_partial(merged, &buf, &len);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+
+    h = blkhash_new();
+    TEST_ASSERT_NOT_NULL_MESSAGE(h, strerror(errno));
+
+    err = blkhash_add_partial(h, buf, len);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+
+    hash_partial(&extents[5], 2, h);
+
+    /* Nothing can be added after an unaligned range. */
+    err = blkhash_add_partial(h, buf, len);
+    TEST_ASSERT_EQUAL_INT(EINVAL, err);
+
+    {
+        unsigned char data[16] = {0};
+        struct blkhash_block block = {
+            .index = 2014,
+            .count = 1,
+            .len = block_size,
+            .zero = true,
+        };
+
+        err = blkhash_update(h, data, sizeof(data));
+        TEST_ASSERT_EQUAL_INT(EINVAL, err);
+
+        err = blkhash_zero(h, block_size);
+        TEST_ASSERT_EQUAL_INT(EINVAL, err);
+
+        err = blkhash_add_block(h, &block);
+        TEST_ASSERT_EQUAL_INT(EINVAL, err);
+    }
+
+    err = blkhash_final(h, md, NULL);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+    format_hex(md, digest_len, hexdigest);
+    TEST_ASSERT_EQUAL_STRING(expected, hexdigest);
+
+    blkhash_free(h);
+    blkhash_free(merged);
+}
+
+void test_abort_quickly()
+{
+    struct blkhash *h;
+    int err;
+
+    h = blkhash_new();
+    TEST_ASSERT_NOT_NULL_MESSAGE(h, strerror(errno));
+
+    for (int i = 0; i < 10; i++) {
+        err = blkhash_zero(h, 3 * GiB);
+        if (err)
+            break;
+    }
+
+    blkhash_free(h);
+
+    /* TODO: check that workers were stopped without doing any work. */
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+}
+
+static void check_false_sharing(const char *name, size_t type_size)
+{
+    if (type_size % CACHE_LINE_SIZE != 0) {
+        size_t padding = CACHE_LINE_SIZE - (type_size % CACHE_LINE_SIZE);
+
+        printf("WARNING: %s is not aligned to cache line size\n", name);
+        printf("  type size: %ld\n", type_size);
+        printf("  cache line size: %d\n", CACHE_LINE_SIZE);
+        printf("  needs padding: %ld\n", padding);
+    }
+}
+
+void test_false_sharing()
+{
+    check_false_sharing("struct config", sizeof(struct config));
+    check_false_sharing("struct submission", sizeof(struct submission));
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_digests);
+
+    RUN_TEST(test_block_data);
+    RUN_TEST(test_block_data_zero);
+    RUN_TEST(test_block_zero);
+
+    RUN_TEST(test_partial_block_data);
+    RUN_TEST(test_partial_block_data_zero);
+    RUN_TEST(test_partial_block_zero);
+
+    RUN_TEST(test_sparse);
+    RUN_TEST(test_sparse_unaligned);
+    RUN_TEST(test_sparse_large);
+
+    RUN_TEST(test_zero);
+    RUN_TEST(test_zero_unaligned);
+
+    RUN_TEST(test_full);
+    RUN_TEST(test_full_unaligned);
 
     RUN_TEST(test_mix);
     RUN_TEST(test_mix_unaligned);
 
+    RUN_TEST(test_zero_md_cache);
+    RUN_TEST(test_zero_md_values);
+    RUN_TEST(test_zero_copy);
+    RUN_TEST(test_zero_copy_error);
+    RUN_TEST(test_wait_stats);
+    RUN_TEST(test_shared_pool);
+    RUN_TEST(test_shared_pool_free);
+    RUN_TEST(test_reset);
+    RUN_TEST(test_reset_aio);
+    RUN_TEST(test_busy_poll);
+    RUN_TEST(test_completion_callback);
+    RUN_TEST(test_auto_threads);
+    RUN_TEST(test_cpus);
+    RUN_TEST(test_multiple_digests);
+    RUN_TEST(test_block_callback);
+    RUN_TEST(test_incremental_rehash);
+    RUN_TEST(test_save_state);
+    RUN_TEST(test_partial);
+
     RUN_TEST(test_abort_quickly);
 
     RUN_TEST(test_false_sharing);
@@ -221,6 +221,104 @@ def test_null_digest(tmpdir):
     assert blksum_file(path, md="null") == ["", path]
 
 
+def test_multiple_digests(tmpdir):
+    path = tmpdir.join("mix.raw")
+    create_image(path, "32k:A 64k:- 32k:0 32k:E 64k:-")
+    bs = Blksum(filename=path, digest=",".join(DIGEST_NAMES))
+    bs.wait(check=True)
+    lines = [line.split("  ") for line in bs.out.splitlines()]
+    assert lines == [blksum_file(path, md=md) for md in DIGEST_NAMES]
+
+
+def test_multiple_digests_pipe(tmpdir):
+    path = tmpdir.join("mix.raw")
+    create_image(path, "32k:A 64k:- 32k:0 32k:E 64k:-")
+    with open(path) as f:
+        bs = Blksum(digest=",".join(DIGEST_NAMES), stdin=f)
+        bs.wait(check=True)
+    lines = [line.split("  ") for line in bs.out.splitlines()]
+    assert lines == [blksum_pipe(path, md=md) for md in DIGEST_NAMES]
+
+
+def test_busy_poll(tmpdir):
+    path = tmpdir.join("mix.raw")
+    create_image(path, "32k:A 64k:- 32k:0 32k:E 64k:- 1m:F 1m:- 32k:G")
+    bs = Blksum(filename=path, busy_poll=50)
+    bs.wait(check=True)
+    assert bs.out.rstrip().split("  ") == blksum_file(path)
+
+
+@pytest.mark.parametrize("threads", ["auto", "1", "8"])
+def test_threads(tmpdir, threads):
+    path = tmpdir.join("mix.raw")
+    create_image(path, "32k:A 64k:- 32k:0 32k:E 64k:- 1m:F 1m:- 32k:G")
+    bs = Blksum(filename=path, threads=threads)
+    bs.wait(check=True)
+    assert bs.out.rstrip().split("  ") == blksum_file(path)
+
+
+def test_threads_auto_pipe(tmpdir):
+    path = tmpdir.join("mix.raw")
+    create_image(path, "32k:A 64k:- 32k:0 32k:E 64k:- 1m:F 1m:- 32k:G")
+    with open(path) as f:
+        bs = Blksum(threads="auto", stdin=f)
+        bs.wait(check=True)
+    assert bs.out.rstrip().split("  ") == blksum_pipe(path)
+
+
+def test_cpus(tmpdir):
+    path = tmpdir.join("mix.raw")
+    create_image(path, "32k:A 64k:- 32k:0 32k:E 64k:- 1m:F 1m:- 32k:G")
+    bs = Blksum(filename=path, cpus="0")
+    bs.wait(check=True)
+    assert bs.out.rstrip().split("  ") == blksum_file(path)
+
+
+@pytest.mark.parametrize("cpus", ["", "a", "3-1", "0,"])
+def test_cpus_invalid(tmpdir, cpus):
+    path = tmpdir.join("mix.raw")
+    create_image(path, "32k:A 64k:- 32k:0")
+    bs = Blksum(filename=path, cpus=cpus)
+    bs.wait()
+    assert bs.returncode != 0
+    assert bs.out == ""
+
+
+def test_resume(tmpdir):
+    path = tmpdir.join("mix.raw")
+    state = tmpdir.join("state")
+    create_image(path, "32k:A 64k:- 32k:0 32k:E 64k:- 1m:F 1m:- 32k:G")
+    bs = Blksum(filename=path, resume=state, checkpoint_interval=0)
+    bs.wait(check=True)
+    assert bs.out.rstrip().split("  ") == blksum_file(path)
+    assert not state.exists()
+
+
+def test_resume_after_signal(tmpdir, term):
+    state = tmpdir.join("state")
+    bs = Blksum(filename=term, resume=state, checkpoint_interval=0)
+    time.sleep(0.2)
+    bs.send_signal(signal.SIGTERM)
+    bs.wait()
+    assert bs.returncode == -signal.SIGTERM
+    assert state.exists()
+
+    bs = Blksum(filename=term, resume=state)
+    bs.wait(check=True)
+    assert bs.out.rstrip().split("  ") == blksum_file(term)
+    assert not state.exists()
+
+
+def test_resume_pipe(tmpdir):
+    path = tmpdir.join("data.raw")
+    create_image(path, "64k:A")
+    with open(path) as f:
+        bs = Blksum(stdin=f, resume=tmpdir.join("state"))
+        bs.wait()
+    assert bs.returncode != 0
+    assert "--resume" in bs.err
+
+
 signals_params = pytest.mark.parametrize("signo,error", [
     pytest.param(signal.SIGINT, "", id="sigint"),
     pytest.param(
@@ -312,11 +410,17 @@ def test_term_qemu_nbd_url(tmpdir, term):
 class Blksum:
 
     def __init__(self, filename=None, digest=None, cache=None, stdin=None,
-                 timeout=10):
+                 resume=None, checkpoint_interval=None, busy_poll=None,
+                 cpus=None, threads=None, timeout=10):
         self.filename = filename
         self.digest = digest
         self.cache = cache
         self.stdin = stdin
+        self.resume = resume
+        self.checkpoint_interval = checkpoint_interval
+        self.busy_poll = busy_poll
+        self.cpus = cpus
+        self.threads = threads
 
         self.cmd = [BLKSUM]
         if self.digest:
@@ -324,6 +428,17 @@ class Blksum:
             self.cmd.append(self.digest)
         if self.cache:
             self.cmd.append("--cache")
+        if self.resume:
+            self.cmd.append(f"--resume={self.resume}")
+        if self.checkpoint_interval is not None:
+            self.cmd.append(
+                f"--checkpoint-interval={self.checkpoint_interval}")
+        if self.busy_poll is not None:
+            self.cmd.append(f"--busy-poll={self.busy_poll}")
+        if self.cpus is not None:
+            self.cmd.append(f"--cpus={self.cpus}")
+        if self.threads is not None:
+            self.cmd.append(f"--threads={self.threads}")
         if self.filename:
             self.cmd.append(self.filename)
 
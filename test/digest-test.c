@@ -2,11 +2,13 @@
 // SPDX-License-Identifier: LGPL-2.1-or-later
 
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "blkhash.h"
 #include "blkhash-config.h"
 #include "digest.h"
+#include "sha256-mb.h"
 #include "unity.h"
 #include "util.h"
 
@@ -177,6 +179,130 @@ void test_sha256()
     }
 }
 
+static void hash_single(const char *name, const void *data, size_t len,
+                        unsigned char *md)
+{
+    struct digest *d = NULL;
+    int err;
+
+    err = digest_create(name, &d);
+    if (err)
+        goto out;
+
+    err = digest_init(d);
+    if (err)
+        goto out;
+
+    err = digest_update(d, data, len);
+    if (err)
+        goto out;
+
+    err = digest_final(d, md, NULL);
+
+out:
+    digest_destroy(d);
+
+    TEST_ASSERT_EQUAL_INT(0, err);
+}
+
+void test_sha256_mb()
+{
+    /* Cover padding in the last block, in a new block, and full blocks. */
+    size_t lengths[] = {0, 3, 55, 56, 63, 64, 65, 119, 120, 4096, 65536};
+    unsigned char *data[SHA256_MB_LANES + 1];
+    unsigned char *mds[SHA256_MB_LANES + 1];
+    unsigned char expected[SHA256_MB_DIGEST_LEN];
+    size_t max_len = 65536;
+
+    if (!sha256_mb_available())
+        TEST_IGNORE_MESSAGE("multi-buffer sha256 not available");
+
+    /* Different content for every lane. */
+    for (unsigned i = 0; i < ARRAY_SIZE(data); i++) {
+        data[i] = malloc(max_len);
+        mds[i] = malloc(SHA256_MB_DIGEST_LEN);
+        TEST_ASSERT_NOT_NULL(data[i]);
+        TEST_ASSERT_NOT_NULL(mds[i]);
+        for (size_t j = 0; j < max_len; j++)
+            data[i][j] = (j * 31 + i * 7) & 0xff;
+    }
+
+    for (unsigned l = 0; l < ARRAY_SIZE(lengths); l++) {
+        /* Partial lanes, full lanes, and more than one group of lanes. */
+        for (unsigned count = 1; count <= ARRAY_SIZE(data); count++) {
+            memset(mds[0], 0, SHA256_MB_DIGEST_LEN);
+
+            sha256_mb((const void **)data, lengths[l], count, mds);
+
+            for (unsigned i = 0; i < count; i++) {
+                hash_single("sha256", data[i], lengths[l], expected);
+                TEST_ASSERT_EQUAL_MEMORY(expected, mds[i],
+                                         SHA256_MB_DIGEST_LEN);
+            }
+        }
+    }
+
+    for (unsigned i = 0; i < ARRAY_SIZE(data); i++) {
+        free(data[i]);
+        free(mds[i]);
+    }
+}
+
+static void check_hash_many(const char *name)
+{
+    /* Runs of blocks with same and different lengths. */
+    size_t lens[] = {4096, 4096, 4096, 100, 4096, 65, 65, 4096, 4096, 0};
+    const void *blocks[ARRAY_SIZE(lens)];
+    unsigned char *mds[ARRAY_SIZE(lens)];
+    unsigned char expected[BLKHASH_MAX_MD_SIZE];
+    unsigned char *data;
+    struct digest *d = NULL;
+    unsigned int md_len;
+    int err;
+
+    data = malloc(4096 + ARRAY_SIZE(lens));
+    TEST_ASSERT_NOT_NULL(data);
+    for (size_t i = 0; i < 4096 + ARRAY_SIZE(lens); i++)
+        data[i] = i * 13;
+
+    for (unsigned i = 0; i < ARRAY_SIZE(lens); i++) {
+        blocks[i] = data + i;
+        mds[i] = malloc(BLKHASH_MAX_MD_SIZE);
+        TEST_ASSERT_NOT_NULL(mds[i]);
+    }
+
+    err = digest_create(name, &d);
+    TEST_ASSERT_EQUAL_INT(0, err);
+
+    err = digest_hash_many(d, blocks, lens, mds, ARRAY_SIZE(lens));
+    TEST_ASSERT_EQUAL_INT(0, err);
+
+    /* Get the digest length. */
+    err = digest_init(d);
+    TEST_ASSERT_EQUAL_INT(0, err);
+    err = digest_final(d, expected, &md_len);
+    TEST_ASSERT_EQUAL_INT(0, err);
+
+    digest_destroy(d);
+
+    for (unsigned i = 0; i < ARRAY_SIZE(lens); i++) {
+        hash_single(name, blocks[i], lens[i], expected);
+        TEST_ASSERT_EQUAL_MEMORY(expected, mds[i], md_len);
+        free(mds[i]);
+    }
+
+    free(data);
+}
+
+void test_hash_many()
+{
+    /* Uses multi-buffer hashing if supported by the CPU. */
+    check_hash_many("sha256");
+
+    /* Hashes one block at a time. */
+    check_hash_many("sha1");
+}
+
 void test_blake2b512()
 {
     struct test_vector tests[] = {
@@ -277,6 +403,8 @@ int main(void)
     RUN_TEST(test_null);
     RUN_TEST(test_null_no_size);
     RUN_TEST(test_sha256);
+    RUN_TEST(test_sha256_mb);
+    RUN_TEST(test_hash_many);
     RUN_TEST(test_blake2b512);
 
 #ifdef HAVE_BLAKE3
@@ -0,0 +1,169 @@
+// SPDX-FileCopyrightText: Red Hat Inc
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+#include "unity.h"
+
+#define PRODUCERS 4
+#define CONSUMERS 4
+#define ITEMS_PER_PRODUCER 100000
+
+void setUp() {}
+void tearDown() {}
+
+void test_empty()
+{
+    struct ring r;
+    int err;
+
+    err = ring_init(&r, 4);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+
+    TEST_ASSERT_EQUAL_INT(0, ring_len(&r));
+    TEST_ASSERT_NULL(ring_pop(&r));
+
+    ring_destroy(&r);
+}
+
+void test_full()
+{
+    struct ring r;
+    int err;
+
+    /* Rounded up to 4. */
+    err = ring_init(&r, 3);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+
+    for (uintptr_t i = 1; i <= 4; i++)
+        TEST_ASSERT_TRUE(ring_push(&r, (void *)i));
+
+    TEST_ASSERT_EQUAL_INT(4, ring_len(&r));
+    TEST_ASSERT_FALSE(ring_push(&r, (void *)5));
+
+    ring_destroy(&r);
+}
+
+void test_fifo()
+{
+    struct ring r;
+    int err;
+
+    err = ring_init(&r, 4);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+
+    /* Wrap around several times. */
+    for (uintptr_t i = 1; i <= 100; i += 3) {
+        TEST_ASSERT_TRUE(ring_push(&r, (void *)i));
+        TEST_ASSERT_TRUE(ring_push(&r, (void *)(i + 1)));
+        TEST_ASSERT_TRUE(ring_push(&r, (void *)(i + 2)));
+
+        TEST_ASSERT_EQUAL_INT(i, (uintptr_t)ring_pop(&r));
+        TEST_ASSERT_EQUAL_INT(i + 1, (uintptr_t)ring_pop(&r));
+        TEST_ASSERT_EQUAL_INT(i + 2, (uintptr_t)ring_pop(&r));
+    }
+
+    TEST_ASSERT_NULL(ring_pop(&r));
+
+    ring_destroy(&r);
+}
+
+struct stress {
+    struct ring ring;
+    uint64_t sum;
+    unsigned producers_done;
+};
+
+static void *producer(void *arg)
+{
+    struct stress *s = arg;
+
+    for (uintptr_t i = 1; i <= ITEMS_PER_PRODUCER; i++) {
+        while (!ring_push(&s->ring, (void *)i))
+            sched_yield();
+    }
+
+    __atomic_add_fetch(&s->producers_done, 1, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+static void *consumer(void *arg)
+{
+    struct stress *s = arg;
+    uint64_t sum = 0;
+    void *value;
+
+    for (;;) {
+        value = ring_pop(&s->ring);
+        if (value) {
+            sum += (uintptr_t)value;
+            continue;
+        }
+
+        if (__atomic_load_n(&s->producers_done, __ATOMIC_ACQUIRE) == PRODUCERS) {
+            /* Producers are done, drain the rest. */
+            while ((value = ring_pop(&s->ring)))
+                sum += (uintptr_t)value;
+            break;
+        }
+
+        sched_yield();
+    }
+
+    __atomic_add_fetch(&s->sum, sum, __ATOMIC_RELAXED);
+
+    return NULL;
+}
+
+void test_stress()
+{
+    struct stress s = {0};
+    pthread_t producers[PRODUCERS];
+    pthread_t consumers[CONSUMERS];
+    uint64_t expected = PRODUCERS *
+        ((uint64_t)ITEMS_PER_PRODUCER * (ITEMS_PER_PRODUCER + 1) / 2);
+    int err;
+
+    err = ring_init(&s.ring, 64);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+
+    for (unsigned i = 0; i < CONSUMERS; i++) {
+        err = pthread_create(&consumers[i], NULL, consumer, &s);
+        TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+    }
+
+    for (unsigned i = 0; i < PRODUCERS; i++) {
+        err = pthread_create(&producers[i], NULL, producer, &s);
+        TEST_ASSERT_EQUAL_INT_MESSAGE(0, err, strerror(err));
+    }
+
+    for (unsigned i = 0; i < PRODUCERS; i++)
+        pthread_join(producers[i], NULL);
+
+    for (unsigned i = 0; i < CONSUMERS; i++)
+        pthread_join(consumers[i], NULL);
+
+    /* Every item was consumed exactly once. */
+    TEST_ASSERT_EQUAL_UINT64(expected, s.sum);
+    TEST_ASSERT_EQUAL_INT(0, ring_len(&s.ring));
+
+    ring_destroy(&s.ring);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_empty);
+    RUN_TEST(test_full);
+    RUN_TEST(test_fifo);
+    RUN_TEST(test_stress);
+
+    return UNITY_END();
+}
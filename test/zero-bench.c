@@ -16,6 +16,7 @@ void tearDown() {}
 
 static unsigned char *buffer;
 static bool quick;
+static const struct zero_variant *variant;
 
 void bench(const char *name, uint64_t size, const void *buf, bool zero)
 {
@@ -30,7 +31,7 @@ void bench(const char *name, uint64_t size, const void *buf, bool zero)
     start = gettime();
 
     for (uint64_t i = 0; i < size / BLOCK_SIZE; i++) {
-        result = is_zero(buf, BLOCK_SIZE);
+        result = variant->is_zero(buf, BLOCK_SIZE);
         if (result != zero)
             break;
     }
@@ -43,7 +44,8 @@ void bench(const char *name, uint64_t size, const void *buf, bool zero)
     hsize = humansize(size);
     hrate = humansize(size / seconds);
 
-    printf("%s: %s in %.3f seconds (%s/s)\n", name, hsize, seconds, hrate);
+    printf("%s %s: %s in %.3f seconds (%s/s)\n",
+           variant->name, name, hsize, seconds, hrate);
 
     free(hsize);
     free(hrate);
@@ -94,8 +96,69 @@ void bench_unaligned_zero()
     bench("unaligned zero", 60 * GiB, p, true);
 }
 
+void bench_copy(const char *name, uint64_t size, const void *buf, bool zero)
+{
+    int64_t start, elapsed;
+    double seconds;
+    char *hsize, *hrate;
+    bool result = !zero;
+    unsigned char *dst;
+
+    dst = malloc(BLOCK_SIZE);
+    assert(dst);
+
+    if (quick)
+        size /= 1024;
+
+    start = gettime();
+
+    for (uint64_t i = 0; i < size / BLOCK_SIZE; i++) {
+        result = copy_unless_zero(dst, buf, BLOCK_SIZE);
+        if (result != zero)
+            break;
+    }
+
+    elapsed = gettime() - start;
+
+    TEST_ASSERT_EQUAL_INT(zero, result);
+    if (!zero)
+        TEST_ASSERT_EQUAL_MEMORY(buf, dst, BLOCK_SIZE);
+
+    seconds = elapsed / 1e6;
+    hsize = humansize(size);
+    hrate = humansize(size / seconds);
+
+    printf("copy %s: %s in %.3f seconds (%s/s)\n", name, hsize, seconds, hrate);
+
+    free(hsize);
+    free(hrate);
+    free(dst);
+}
+
+void bench_copy_data_best()
+{
+    memset(buffer, 0x55, BLOCK_SIZE);
+    bench_copy("data best", 20 * GiB, buffer, false);
+}
+
+void bench_copy_data_worst()
+{
+    memset(buffer, 0, BLOCK_SIZE);
+    buffer[BLOCK_SIZE-1] = 0x55;
+    bench_copy("data worst", 20 * GiB, buffer, false);
+}
+
+void bench_copy_zero()
+{
+    memset(buffer, 0, BLOCK_SIZE);
+    bench_copy("zero", 60 * GiB, buffer, true);
+}
+
 int main(int argc, char *argv[])
 {
+    const struct zero_variant *variants;
+    unsigned count;
+
     /* Extract bytes for testing unalinged buffers. */
     buffer = malloc(BLOCK_SIZE + 5);
     assert(buffer);
@@ -103,15 +166,25 @@ int main(int argc, char *argv[])
     /* Minimal test for CI and build machines. */
     quick = (argc > 1 && strcmp(argv[1], "quick") == 0);
 
+    count = zero_variants(&variants);
+
     UNITY_BEGIN();
 
-    RUN_TEST(bench_aligned_data_best);
-    RUN_TEST(bench_aligned_data_worst);
-    RUN_TEST(bench_aligned_zero);
+    for (unsigned i = 0; i < count; i++) {
+        variant = &variants[i];
+
+        RUN_TEST(bench_aligned_data_best);
+        RUN_TEST(bench_aligned_data_worst);
+        RUN_TEST(bench_aligned_zero);
+
+        RUN_TEST(bench_unaligned_data_best);
+        RUN_TEST(bench_unaligned_data_worst);
+        RUN_TEST(bench_unaligned_zero);
+    }
 
-    RUN_TEST(bench_unaligned_data_best);
-    RUN_TEST(bench_unaligned_data_worst);
-    RUN_TEST(bench_unaligned_zero);
+    RUN_TEST(bench_copy_data_best);
+    RUN_TEST(bench_copy_data_worst);
+    RUN_TEST(bench_copy_zero);
 
     free(buffer);
 